@@ -3,6 +3,7 @@
  *
  * <Put your name and login ID here>
  */
+#define _GNU_SOURCE         /* prlimit */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,26 +13,75 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <poll.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXTOKENS  4096   /* max jobserver tokens we create */
+#define MAXDONE      64   /* finished jobs remembered for wait, a power of 2 */
+#define TICK_MS     100   /* timer wheel resolution in ms */
+#define WHEELSIZE   256   /* timer wheel slots, a power of 2 */
+#define DEFGRACE   5000   /* ms from SIGTERM to SIGKILL for a timed out job */
+#define MAXARGBUF (1<<15) /* max bytes of paths a command's globs expand to */
+#define DIRBUF    (1<<18) /* bytes of directory entries read per getdents64 */
+#define MAXPAT      256   /* max ops in one component of a glob pattern */
+#define MAXCLASS     16   /* max [...] classes in one component */
+#define MAXCOMP      64   /* max components (a/b/c) of a glob pattern */
+
+/* Jobserver tokens held by a job */
+#define NOTOKEN  -1       /* none */
+#define IMPLICIT 256      /* the shell's own implicit token */
+
+/* Glob pattern ops, besides literal bytes 0-255 */
+#define GLOB_ANY   256    /* ? */
+#define GLOB_STAR  257    /* * */
+#define GLOB_CLASS 258    /* [...]: GLOB_CLASS+k for class k */
+
+/*
+ * Hot-path trace points, compiled in only with -DTSH_TRACE (make
+ * tsh-trace).  Spans and instants go to a per-process ring buffer that
+ * the tracedump builtin or SIGUSR1 writes out as Chrome trace JSON,
+ * which chrome://tracing and ui.perfetto.dev load directly.
+ */
+#ifdef TSH_TRACE
+#define TRACEBUF   (1<<16) /* trace events kept, a power of 2 */
+#define TRACE_BEGIN(name) tracepoint(name, 'B')
+#define TRACE_END(name)   tracepoint(name, 'E')
+#define TRACE_MARK(name)  tracepoint(name, 'i')
+#else
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#define TRACE_MARK(name)
+#endif
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define WT 4    /* waiting for prerequisite jobs */
 
 /*
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ *     WT (waiting, not started yet)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     WT -> BG  : last prerequisite finished (after command)
  * At most 1 job can be in the FG state.
  */
 
@@ -39,16 +89,128 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
-int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+int js_rfd = -1;            /* jobserver pipe/fifo, -1 if none; read end */
+int js_wfd = -1;            /*     is private to us and non-blocking */
+int js_implicit = 1;        /* implicit token is not held by any job */
+int ev_fd = -1;             /* job event stream (-e), -1 if none */
+volatile sig_atomic_t ev_dropped = 0; /* events lost to a slow reader */
+int jobcontrol = 0;         /* true if we hand the terminal to FG jobs */
+pid_t shell_pgid;           /* our process group, owns the terminal otherwise */
+struct termios shell_tmodes; /* our terminal modes */
+int cg_dir = -1;            /* -c: cgroup holding our job cgroups, -1 if none */
+char cg_path[MAXLINE];      /*     and its path */
+pid_t cg_busy[MAXJOBS];     /* -c: cgroups of done jobs that setsid */
+int ncg_busy = 0;           /*     descendants still keep from removal */
+int hist_fd = -1;           /* history file (-H), -1 if none */
+char *hist_map = NULL;      /* the history file, mapped read-only */
+size_t hist_maplen = 0;     /* bytes of it mapped */
+size_t hist_indexed = 0;    /* bytes of it indexed into hist_off */
+long *hist_off = NULL;      /* record i is hist_off[i] to hist_off[i+1]-1 */
+int hist_n = 0;             /* records indexed */
+int hist_cap = 0;           /* room in hist_off */
+int *hist_sorted = NULL;    /* the first hist_nsorted records in */
+int hist_nsorted = 0;       /*     lexical order, for prefix search */
+
+struct var_t {              /* A shell variable */
+    char *str;              /* "NAME=value", malloc'd */
+    int namelen;            /* length of NAME */
+    int exported;           /* in the environment of our children */
+};
+struct var_t *vars = NULL;  /* The variables, sorted by name */
+int nvars = 0;              /* variables set */
+int varcap = 0;             /* room in vars */
+char **childenv = NULL;     /* envp for execve: the exported variables' */
+int nchildenv = 0;          /*     strings, rebuilt only when they change */
+char globarg[MAXARGS];      /* parseline: argv[i] is an unquoted pattern */
+
+struct pat_t {              /* One component of a compiled glob pattern */
+    char *lit;              /* the component as written, unescaped if !meta */
+    int meta;               /* has *, ? or [...]; else it is taken literally */
+    int n;                  /* ops */
+    short op[MAXPAT];       /* a byte, GLOB_ANY, GLOB_STAR or GLOB_CLASS+k */
+    int nclass;             /* classes */
+    unsigned char cls[MAXCLASS][32]; /* bitmap of the bytes class k matches */
+    int minlen;             /* no shorter name can match */
+    int ntail;              /* ops after the last *, all bytes: tried first */
+};
+struct pat_t globpat[MAXCOMP]; /* The pattern being expanded */
+int nglobpat = 0;           /* its components */
+int globdirs = 0;           /* it ends in '/': only directories match */
+char globpath[PATH_MAX];    /* the path matched so far */
+
+struct globout_t {          /* Paths a glob expanded to, for expandargv */
+    char **argv;            /* go into argv[argc...] */
+    int argc;
+    char *next;             /* and their text into a buffer, up to end */
+    char *end;
+};
+
+struct apply_t {            /* The batch that apply is filling */
+    char *argv[MAXARGS];    /* the command, then the batch's paths */
+    int ncmd;               /* words of the command */
+    int argc;               /* words so far */
+    int max;                /* paths per batch */
+    char buf[MAXARGBUF];    /* text of the paths */
+    char *next;             /* free space in buf */
+    int files;              /* paths so far */
+    int jobs;               /* batches started */
+};
+
+struct limit_t {            /* Limits set by the timeout builtin */
+    long long wall;         /* ms of wall-clock time, 0 if unlimited */
+    long long grace;        /* ms between SIGTERM and SIGKILL */
+    long long cpu;          /* ms of CPU time per process, 0 if unlimited */
+};
 
 struct job_t {              /* The job struct */
     pid_t pid;              /* job PID */
     int jid;                /* job ID [1, 2, ...] */
-    int state;              /* UNDEF, BG, FG, or ST */
+    int state;              /* UNDEF, BG, FG, ST or WT */
     char cmdline[MAXLINE];  /* command line */
+    int ndeps;              /* WT: number of unfinished prerequisites */
+    int deps[MAXJOBS];      /* WT: JIDs of those prerequisites */
+    int onsuccess;          /* WT: start only if all of them exit 0 */
+    char *argv[MAXARGS];    /* WT: argv to launch, points into argbuf */
+    char argbuf[MAXLINE];
+    int token;              /* jobserver token held, NOTOKEN if none */
+    int resume;             /* ST: bg'd, to continue once it has a token */
+    long long start;        /* CLOCK_MONOTONIC ns when it was spawned */
+    int hastmodes;          /* tmodes saved when it was last stopped */
+    struct termios tmodes;  /* terminal modes it left behind */
+    struct limit_t lim;     /* timeout limits, applied once it runs */
+    int tstage;             /* timer due: 0 none, 1 SIGTERM, 2 SIGKILL */
+    int tslot;              /* timer wheel slot it is linked into */
+    unsigned int trounds;   /* wheel turns left before it fires */
+    struct job_t *tnext;    /* timer wheel slot list */
+    struct job_t *tprev;
+    int cgfreeze;           /* -c: its cgroup.freeze and cgroup.events, */
+    int cgevents;           /*     -1 if it has no cgroup */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct done_t {             /* A finished job, as seen by the reap path */
+    pid_t pid;              /* its PID, 0 if it never started */
+    int jid;                /* its job ID */
+    int status;             /* wait status, -1 if it was cancelled */
+};
+struct done_t donelog[MAXDONE]; /* The last MAXDONE finished jobs */
+volatile unsigned int ndone = 0; /* jobs ever finished */
+volatile sig_atomic_t interrupted = 0; /* ctrl-c with no FG job */
+
+struct job_t *wheel[WHEELSIZE]; /* Timer wheel: jobs due in each slot */
+unsigned int wheelpos = 0;  /* slot of the current tick */
+int ntimers = 0;            /* armed timers; the tick stops at 0 */
+
+#ifdef TSH_TRACE
+struct trace_t {            /* A trace event */
+    char *name;             /* trace point */
+    char ph;                /* Chrome phase: B(egin), E(nd) or i(nstant) */
+    long long ts;           /* CLOCK_MONOTONIC ns */
+};
+struct trace_t tracebuf[TRACEBUF]; /* The trace ring buffer */
+unsigned int ntrace = 0;    /* events ever recorded */
+#endif
 /* End global variables */
 
 
@@ -58,11 +220,21 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
+void do_after(char **argv);
+void do_wait(char **argv);
+void do_timeout(char **argv);
+void do_kill(char **argv);
+void do_history(char **argv);
+void do_export(char **argv);
+void do_unset(char **argv);
+void do_apply(char **argv);
 void waitfg(pid_t pid);
+pid_t spawn(char **argv, int fg, struct limit_t *lim);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void sigalrm_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv);
@@ -76,8 +248,93 @@ int deletejob(struct job_t *jobs, pid_t pid);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid);
+int parseid(char *cmd, char *id, int *numid);
+struct job_t *parsejobid(char *cmd, char *id);
+int parsejobs(char *cmd, char **args, struct job_t **found, int *argno, int *missing);
+int parsesig(char *name);
+int signaljob(struct job_t *job, int sig);
 int pid2jid(pid_t pid);
 void listjobs(struct job_t *jobs);
+int argvsize(char **argv);
+void saveargv(struct job_t *job, char **argv);
+void jobdone(struct job_t *job, int status);
+void launchready(struct job_t *jobs);
+int resumebg(struct job_t *job);
+
+int openprivate(int fd, int flags);
+void initjobserver(int ntokens);
+void joinjobserver(void);
+int gettoken(void);
+int waittoken(sigset_t *prev);
+void watchjobserver(void);
+void puttoken(int token);
+
+void openevents(char *dest);
+void jobevent(char *ev, struct job_t *job, pid_t pid, char *key, long long val);
+long long nsnow(void);
+char *putstr(char *dst, char *src);
+char *putnum(char *dst, long long n);
+
+#ifdef TSH_TRACE
+void tracepoint(char *name, char ph);
+int tracedump(char *file);
+void sigusr1_handler(int sig);
+#endif
+
+long long parsems(char *s);
+int parselimits(char **argv, struct limit_t *lim);
+int cmdlimits(char **argv, struct limit_t *lim);
+int isbuiltin(char *name);
+int cpurlimit(struct limit_t *lim, struct rlimit *rl);
+void setlimits(struct job_t *job);
+void armtimer(struct job_t *job, long long ms, int stage);
+void disarmtimer(struct job_t *job);
+
+void initterminal(void);
+void giveterminal(struct job_t *job);
+void taketerminal(pid_t pid);
+
+void initcgroups(void);
+void sweepcgroups(char *dir);
+void endcgroups(void);
+void cgenter(void);
+void cgopen(struct job_t *job);
+int cgfreeze(struct job_t *job, int frozen);
+int cgfrozen(struct job_t *job);
+void cgremove(struct job_t *job);
+int cgrmdir(pid_t pid);
+void markfrozen(struct job_t *job);
+
+void openhistory(char *file);
+void histadd(char *cmdline);
+int histsync(void);
+int histlen(int i);
+int histcmp(const void *a, const void *b);
+void histsort(void);
+int histnumcmp(const void *a, const void *b);
+int histprefix(char *prefix, int *found);
+int histsearch(char *substr, int *found);
+
+void initvars(void);
+int assignment(char *word);
+int findvar(char *name, int len, int *pos);
+char *getvar(char *name, int len);
+int setvar(char *str, int exported);
+void unsetvar(char *name);
+void buildenv(void);
+void execwith(char **argv, int n);
+int expandvar(const char **src, char **dst, char *end);
+
+int globcompile(char *pattern);
+int patcompile(struct pat_t *p, char *s);
+int globmatch(struct pat_t *p, const char *name, int len);
+int globwalk(int c, int plen, int (*found)(char *path, void *arg), void *arg);
+int globrun(char *pattern, int (*found)(char *path, void *arg), void *arg);
+int globcmp(const void *a, const void *b);
+int globcollect(char *path, void *arg);
+int expandargv(char **argv);
+int applyfound(char *path, void *arg);
+int applylaunch(struct apply_t *ap);
 
 void usage(void);
 void unix_error(char *msg);
@@ -93,13 +350,20 @@ int main(int argc, char **argv)
     char c;
     char cmdline[MAXLINE];
     int emit_prompt = 1; /* emit prompt (default) */
+    int ntokens = 0;     /* -j: run our own jobserver */
+    int cgroups = 0;     /* -c: a cgroup per job */
+    char *histfile = NULL; /* -H: history file */
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
+    /* Write each line as it is printed, so that a job report from the
+     * SIGCHLD handler is not held back until after the next command */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvpcj:e:H:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -110,6 +374,19 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'c':             /* stop/continue jobs with the cgroup freezer */
+            cgroups = 1;
+	    break;
+        case 'j':             /* share <n> job slots via a jobserver */
+            if ((ntokens = atoi(optarg)) < 1)
+                usage();
+	    break;
+        case 'e':             /* stream job events to fd or file */
+            openevents(optarg);
+	    break;
+        case 'H':             /* keep the command history in a file */
+            histfile = optarg;
+	    break;
 	default:
             usage();
 	}
@@ -121,13 +398,43 @@ int main(int argc, char **argv)
     Signal(SIGINT,  sigint_handler);   /* ctrl-c */
     Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
     Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    Signal(SIGALRM, sigalrm_handler);  /* Timer wheel tick */
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler);
 
+#ifdef TSH_TRACE
+    /* Dump the trace buffer without disturbing the shell */
+    Signal(SIGUSR1, sigusr1_handler);
+#endif
+
     /* Initialize the job list */
     initjobs(jobs);
 
+    /* Let the kernel send ctrl-c/ctrl-z straight to FG jobs on a tty */
+    initterminal();
+
+    /* Freeze and thaw whole job trees instead of signaling a process group */
+    if (cgroups)
+        initcgroups();
+
+    /* Map the history file; an interactive shell keeps one by default */
+    if (histfile == NULL && emit_prompt && isatty(STDIN_FILENO) && getenv("HOME")) {
+        snprintf(sbuf, MAXLINE, "%s/.tsh_history", getenv("HOME"));
+        histfile = sbuf;
+    }
+    if (histfile)
+        openhistory(histfile);
+
+    /* Limit & jobs (and the makes they run) to a shared set of job slots */
+    if (ntokens)
+        initjobserver(ntokens);
+    else
+        joinjobserver();
+
+    /* Take over the environment (with MAKEFLAGS) as exported variables */
+    initvars();
+
     /* Execute the shell's read/eval loop */
     while (1) {
 
@@ -143,7 +450,8 @@ int main(int argc, char **argv)
 	    exit(0);
 	}
 
-	/* Evaluate the command line */
+	/* Record it, then evaluate it */
+	histadd(cmdline);
 	eval(cmdline);
 	fflush(stdout);
 	fflush(stdout);
@@ -199,9 +507,13 @@ void eval(char *cmdline)
     char buf[MAXLINE];                                                          // 保存修改的命令行
     int bg;                                                                     // 用于记录是否为后台进程
     pid_t pid;                                                                  // 进程pid
+    int jid, token = NOTOKEN;                                                   // 任务的 jobserver 令牌
+    int bi;                                                                     // 是否为内置命令
+    struct limit_t lim;                                                         // timeout ... -- 给出的限制
+    struct job_t *job;
 
     // trace05 add
-    sigset_t mask;
+    sigset_t mask, prev;
     sigemptyset(&mask);
 
     strcpy(buf, cmdline);
@@ -210,29 +522,64 @@ void eval(char *cmdline)
     {
         return;
     }
+    if (expandargv(argv) < 0)                                                   // 展开 *.c 这样的模式，放不下就不执行
+    {
+        return;
+    }
+    if (cmdlimits(argv, &lim) < 0)                                              // timeout ... -- cmd：剥掉前缀，记下限制
+    {
+        return;
+    }
 
-    if (!builtin_cmd(argv))                                                     // 判断是否为内置命令
+    TRACE_BEGIN("builtin_cmd");
+    bi = builtin_cmd(argv);
+    TRACE_END("builtin_cmd");
+    if (!bi)                                                                    // 判断是否为内置命令
     {
         // trace05 add
         sigaddset(&mask, SIGCHLD);
-        sigprocmask(SIG_BLOCK, &mask, NULL);                                    // 判断不是内置命令之后，阻断 SIGCHLD 信号
+        sigaddset(&mask, SIGALRM);                                              // 计时轮也要改任务表
+        sigprocmask(SIG_BLOCK, &mask, &prev);                                   // 判断不是内置命令之后，阻断 SIGCHLD 信号
 
-        if ((pid = fork()) == 0)                                                // 子程序运行用户作业
+        launchready(jobs);                                                      // 别的进程可能已经归还了令牌
+        if (bg && (token = gettoken()) == NOTOKEN)                              // 后台任务要先拿到 jobserver 令牌
         {
-            // trace05 add
-            sigprocmask(SIG_UNBLOCK, &mask, NULL);                              // 在子进程 execve 之前，恢复信号
-
-            // trace06 add
-            setpgid(0, 0);                                                      // 防止^C将其退出（直接与 Unix shell 绑定）
-
-            if (execve(argv[0], argv, environ) < 0)                             // 若无法查到路径下可执行文件，则报错并退出
+            if (argvsize(argv) > MAXLINE)                                       // 通配符展开后可能放不进 argbuf
+                printf("%s: Argument list too long to queue\n", argv[0]);
+            else if ((jid = addjob(jobs, 0, WT, cmdline)) != 0)                 // 拿不到就排队，由回收路径在有令牌时启动
             {
-                printf("%s: Command not found\n", argv[0]);
-                exit(0); // here only child exited
+                job = getjobjid(jobs, jid);
+                saveargv(job, argv);
+                job->lim = lim;
+                printf("[%d] (-) %s", jid, cmdline);
             }
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
+            return;
+        }
+        if (!bg && (token = waittoken(&prev)) == NOTOKEN)                       // 前台任务也占一个令牌，没有就等，ctrl-c 放弃
+        {
+            printf("Interrupted waiting for a job slot\n");
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
+            return;
         }
-        addjob(jobs, pid, bg ? BG : FG, cmdline);                               // 添加job到列表中
+
+        if ((pid = spawn(argv, !bg, &lim)) < 0)                                 // 子程序运行用户作业
+        {
+            unix_error("fork error");
+        }
+        if ((jid = addjob(jobs, pid, bg ? BG : FG, cmdline)) != 0)              // 添加job到列表中
         // 代码的 addjob 中第三个参数 state 有三个取值，FG=1、BG=2、ST=3。虽然直接使用 bg+1 也是可行的方案，但这样使用三元运算符会更优雅更容易理解。
+        {
+            job = getjobjid(jobs, jid);
+            job->token = token;
+            job->lim = lim;
+            cgopen(job);
+            setlimits(job);
+        }
+        else
+        {
+            puttoken(token);
+        }
 
         // trace05 add
         sigprocmask(SIG_UNBLOCK, &mask, NULL);                                  // 父进程 addjob 完毕后也要恢复
@@ -257,61 +604,152 @@ void eval(char *cmdline)
     return;
 }
 
+/*
+ * spawn - Fork a child that runs argv in a new process group, which
+ *    gets the terminal if it is a foreground (fg) job.  The CPU limit
+ *    in lim (may be NULL) is set before execve, so every process the
+ *    job forks inherits it.  Called with SIGCHLD blocked, both from
+ *    eval and from the reap path when a waiting job becomes runnable.
+ *    Returns the child's PID.
+ */
+pid_t spawn(char **argv, int fg, struct limit_t *lim)
+{
+    pid_t pid;
+    sigset_t mask, prev;
+    struct rlimit rl;
+    char msg[MAXLINE + 32];
+    int n;
+
+    TRACE_BEGIN("fork");
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &prev);                                       // 子进程 execve 之前收到的信号不能交给继承来的处理程序
+    if ((pid = fork()) == 0)
+    {
+        signal(SIGINT, SIG_DFL);                                                // 先恢复默认处理，再解除阻断
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+
+        // trace06 add
+        setpgid(0, 0);                                                          // 防止^C将其退出（直接与 Unix shell 绑定）
+        cgenter();                                                              // execve 之前进入任务的 cgroup，之后 fork 的也都在里面
+        if (lim != NULL && cpurlimit(lim, &rl))                                 // 同理，CPU 限制也要在 fork 出孙进程之前设好
+            setrlimit(RLIMIT_CPU, &rl);
+
+        if (jobcontrol)                                                         // 父子进程都设置一次，谁先运行都不会有竞争
+        {
+            if (fg)
+                tcsetpgrp(STDIN_FILENO, getpid());
+            signal(SIGTTOU, SIG_DFL);                                           // 被忽略的信号会跨 execve 继承，要恢复
+            signal(SIGTTIN, SIG_DFL);
+        }
+
+        // trace05 add
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);                                  // 在子进程 execve 之前，恢复信号
+
+        for (n = 0; argv[n] != NULL && assignment(argv[n]); n++)                // VAR=val cmd：只改这个子进程的环境
+            ;
+        if (argv[n] == NULL)                                                    // 排队的任务可能只有赋值
+            _exit(0);
+        if (n == 0)
+            execve(argv[0], argv, childenv);                                    // 没有前缀就直接用缓存的环境，什么都不复制
+        else
+            execwith(argv, n);
+        argv += n;
+
+        // 若无法查到路径下可执行文件，execve 返回，则报错并退出
+        // 可能是在信号处理程序中 fork 出来的，父进程的 stdout 缓冲区里或许还有内容，所以直接 write
+        snprintf(msg, sizeof(msg), "%s: Command not found\n", argv[0]);
+        write(STDOUT_FILENO, msg, strlen(msg));
+        jobevent("execfail", NULL, getpid(), "errno", errno);
+        _exit(127); // here only child exited
+    }
+    if (pid > 0)
+    {
+        setpgid(pid, pid);                                                      // 父进程也设置，之后立刻 kill(-pid) 才不会 ESRCH
+        if (fg && jobcontrol)
+            tcsetpgrp(STDIN_FILENO, pid);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    TRACE_END("fork");
+    return pid;
+}
+
 /*
  * parseline - Parse the command line and build the argv array.
  *
  * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
+ * argument.  Elsewhere $NAME, ${NAME} and $$ are replaced by the
+ * variable's value (or the shell's PID) as the words are copied out,
+ * in the same pass over the line; a word that expands to nothing is
+ * dropped.  Unquoted words with *, ? or [ are flagged in globarg for
+ * expandargv.  Return true if the user has requested a BG job, false if
  * the user has requested a FG job.
  */
 int parseline(const char *cmdline, char **argv)
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
+    static char array[MAXLINE]; /* holds the words, expanded */
+    const char *src = cmdline;  /* ptr that traverses command line */
+    char *dst = array;          /* where the next char of a word goes */
+    char *end = array + MAXLINE - 1; /* room left for a '\0' */
+    char *delim;                /* closing quote */
     int argc;                   /* number of args */
     int bg;                     /* background job? */
+    int expanded;               /* word had a $ expansion */
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
+    TRACE_BEGIN("parseline");
 
     /* Build the argv list */
     argc = 0;
-    if (*buf == '\'') {
-	      buf++;
-	      delim = strchr(buf, '\'');
-    }
-    else
-    {
-	      delim = strchr(buf, ' ');
-    }
-
-    while (delim)
-    {
-	      argv[argc++] = buf;
-	      *delim = '\0';
-	      buf = delim + 1;
-    	  while (*buf && (*buf == ' ')) /* ignore spaces */
-    	       buf++;
-    	  if (*buf == '\'') {
-    	       buf++;
-    	       delim = strchr(buf, '\'');
-    	  }
-        else {
-    	       delim = strchr(buf, ' ');
-    	  }
+    while (argc < MAXARGS - 1) {
+	while (*src == ' ')     /* ignore spaces */
+	    src++;
+	if (*src == '\0' || *src == '\n')
+	    break;
+	argv[argc] = dst;
+	expanded = 0;
+	globarg[argc] = 0;
+	if (*src == '\'') {
+	    if ((delim = strchr(++src, '\'')) == NULL)
+		break;          /* no closing quote: drop the rest */
+	    while (src < delim && dst < end)
+		*dst++ = *src++;
+	    src = delim + 1;
+	}
+	else {
+	    while (*src != ' ' && *src != '\0' && *src != '\n') {
+		if (*src == '$')
+		    expanded |= expandvar(&src, &dst, end);
+		else if (dst < end)
+		    *dst++ = *src++;
+		else
+		    src++;
+	    }
+	    if (dst == argv[argc] && expanded)
+		continue;       /* $UNSET alone is no word */
+	    *dst = '\0';
+	    globarg[argc] = strpbrk(argv[argc], "*?[") != NULL;
+	}
+	*dst = '\0';
+	if (dst < end)
+	    dst++;
+	argc++;
     }
     argv[argc] = NULL;
 
-    if (argc == 0)  /* ignore blank line */
+    if (argc == 0) {  /* ignore blank line */
+        TRACE_END("parseline");
         return 1;
+    }
 
     /* should the job run in the background? */
     if ((bg = (*argv[argc-1] == '&')) != 0) {
         argv[--argc] = NULL;
     }
+    TRACE_END("parseline");
     return bg;
 }
 
@@ -333,6 +771,21 @@ trace10.txt – 处理 fg 内置命令
 */
 int builtin_cmd(char **argv)
 {
+    int i, n;
+
+    for (n = 0; argv[n] != NULL && assignment(argv[n]); n++)                    // VAR=val ... 开头的赋值
+        ;
+    if (n > 0 && argv[n] == NULL)                                               // 只有赋值：设置 shell 变量
+    {
+        for (i = 0; i < n; i++)
+            setvar(argv[i], 0);
+        return 1;
+    }
+    if (n > 0)                                                                  // 后面是命令：赋值只进它的环境，由子进程处理；内置命令忽略
+    {
+        return builtin_cmd(argv + n);
+    }
+
     if (strcmp(argv[0], "quit") == 0)                                           // 判断是否为 quit 指令
         exit(0);
 
@@ -349,6 +802,63 @@ int builtin_cmd(char **argv)
         return 1;                                                               // 用来告诉`eval`已经找到了一个内置命令
     }
 
+    if (strcmp(argv[0], "after") == 0)
+    {
+        do_after(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "wait") == 0)
+    {
+        do_wait(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "timeout") == 0)
+    {
+        do_timeout(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "kill") == 0)
+    {
+        do_kill(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "history") == 0)
+    {
+        do_history(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "export") == 0)
+    {
+        do_export(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "unset") == 0)
+    {
+        do_unset(argv);
+        return 1;
+    }
+
+    if (strcmp(argv[0], "apply") == 0)
+    {
+        do_apply(argv);
+        return 1;
+    }
+
+#ifdef TSH_TRACE
+    if (strcmp(argv[0], "tracedump") == 0)                                      // tracedump [file]
+    {
+        if (tracedump(argv[1]) < 0)
+            printf("tracedump: %s\n", strerror(errno));
+        return 1;
+    }
+#endif
+
     return 0;
 }
 
@@ -370,368 +880,2918 @@ trace10.txt – 处理 fg 内置命令
     正常情况下，JID/PID 并不应该包含除开头 % 号外的字符，所以 end 指向的应该是表示字符串结尾的 \0。
     然后就是调用 getjobjid 得到 job 了，再加一个是否存在的判断。
   * 对于 PID 的情况，不同的地方只在于没有自增，换了适用于 PID 的函数，以及提示信息改变而已。
+  这部分解析后来抽到了 parsejobid 中，又扩展成了一次解析多个任务（%1-%5、%stopped 等）的 parsejobs，kill、after 等内置命令也要用。
 */
 void do_bgfg(char **argv)
 {
-    char *id = argv[1], *end;                                                   // *id = JID or PID, *end 指向被转换的最后一个数字的下一个字符
-    struct job_t *job;
-    int numid;
+    struct job_t *found[MAXJOBS], *job, *fgjob = NULL;                          // 一次可以给多个任务：%1 %3-%5 %stopped
+    int argno[MAXJOBS], i, n, last;
+    sigset_t mask, prev;
 
-    if (id == NULL)                                                             // 检查参数是否存在
+    if (argv[1] == NULL)                                                        // 检查参数是否存在
     {
         printf("%s command requires PID or %%jobid argument\n", argv[0]);
         return;
     }
 
-    if (id[0] == '%')                                                           // this is a job (JID)
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);                                       // 解析出的任务在用完之前不能被回收
+
+    if ((n = parsejobs(argv[0], argv + 1, found, argno, NULL)) < 0)             // 解析 JID/PID，出错信息已在其中打印；不存在的跳过
     {
-        id++;                                                                   // 将 id 指针自增 1，是为了让指针指向第一个数字
-        numid = strtol(id, &end, 10);                                           // 使用 strtol 功能将其从字符串转为数字。
-        // 在转换的过程中，end 会被设定为指向被转换的最后一个数字的下一个字符。
-        // 正常情况下，JID/PID 并不应该包含除开头 % 号外的字符，所以 end 指向的应该是表示字符串结尾的 \0。
-        if (*end != '\0')
-        // 不能非数字字符（不然 end 将不是指向 \0，而是指向到最后一个不能转换的字符）
-        {
-            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-            return;
-        }
-        job = getjobjid(jobs, numid);                                           // 获取 job
-        if (job == NULL)                                                        // 检查是否存在
-        {
-            printf("%%%d: No such job\n", numid);
-            return;
-        }
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
     }
-    else                                                                        // this is a process (PID)
+    if (strcmp(argv[0], "fg") == 0 && n > 0)                                    // fg 多个任务时，最后一个参数给出的放到前台，其余放到后台
+    {
+        for (last = 0; argv[last+2] != NULL; last++)
+            ;
+        fgjob = found[n-1];                                                     // found[] 是任务表的顺序，最后一个参数不存在时才用它
+        for (i = 0; i < n; i++)
+            if (argno[i] == last)                                               // 是范围时取其中最后一个
+                fgjob = found[i];
+    }
+    for (i = 0; i < n; i++)
     {
-        // 对于 PID 的情况，不同的地方只在于没有自增，换了适用于 PID 的函数，以及提示信息改变而已。
-        numid = strtol(id, &end, 10);                                           // 同上
-        if (*end != '\0')
+        job = found[i];
+        if (job->state == WT)                                                   // 还没启动，没有进程组可以发信号
         {
-            printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-            return;
+            printf("%%%d: Job has not started\n", job->jid);
+            if (job == fgjob)
+                fgjob = NULL;
+            continue;
         }
-        job = getjobpid(jobs, numid); // try to get proc
-        if (job == NULL)
+        // 根据前台或者后台的要求，做出相应的行为，这与 eval 最后的行为比较类似。
+        if (job == fgjob)                                                       // fg
         {
-            printf("(%d): No such process\n", atoi(id));
-            return;
+            giveterminal(job);                                                  // 先把终端交给它，否则一继续就会因读终端收到 SIGTTIN
+            job->resume = 0;                                                    // 在排队等令牌的也直接放到前台
+            signaljob(job, SIGCONT);                                            // 全组向前台发送信号
+            jobevent("cont", job, job->pid, NULL, 0);
+            job->state = FG;
+            jobevent("fg", job, job->pid, NULL, 0);
         }
+        else if (resumebg(job))                                                 // bg：和 & 任务一样要先拿到 jobserver 令牌
+            printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+        else
+            printf("%%%d: Waiting for a job slot\n", job->jid);
     }
-    kill(-(job->pid), SIGCONT);                                                 // 全组向前台发送信号
-    // 根据前台或者后台的要求，做出相应的行为，这与 eval 最后的行为比较类似。
-    if (strcmp(argv[0], "fg") == 0)                                             // bg
-    {
-        job->state = FG;
-        waitfg(job->pid);
-    }
-    else                                                                        // fg
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    if (fgjob != NULL)
     {
-        job->state = BG;
-        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+        waitfg(fgjob->pid);
     }
     return;
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * do_after - Execute the builtin after command
+ *
+ *     after [-s] <job> ... -- <command> [&]
+ *
+ * Jobs are given as for kill, e.g. after %running -- <command>.
+ * Queue command as a background job in the WT state.  It is started
+ * from the SIGCHLD reap path as soon as every listed job has finished,
+ * so independent chains run in parallel.  With -s it only starts if
+ * every prerequisite exited with status 0, and is cancelled otherwise.
  */
-/*
-trace05.txt – 处理 jobs 内置命令。
-  Writeup 提示
-    > 实验有一个棘手的部分，是决定 waitfg 和 sigchld 处理函数之间的工作分配。我们推荐以下方法：
-    > – 在 waitfg 中，用一个死循环包裹 sleep 函数。
-    > – 在 sigchild_handler 中，调用且仅调用一次 waitpid。
-*/
-void waitfg(pid_t pid)
+void do_after(char **argv)
 {
-    while (pid == fgpid(jobs))
+    char **cmd, **args = argv + 1, *dst, cmdline[MAXLINE];
+    int n, jid, ndeps, missing, onsuccess = 0;
+    struct job_t *job, *found[MAXJOBS];
+    sigset_t mask, prev;
+
+    if (*args != NULL && strcmp(*args, "-s") == 0)
     {
-        sleep(0);
+        onsuccess = 1;
+        args++;
     }
-    return;
-}
-
-/*****************
- * Signal handlers
- *****************/
 
-/*
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.
- */
-/*
-trace05.txt – 处理 jobs 内置命令。
-  涉及到对 waitpid 函数的更深入理解，在 CSAPP 8.4.3 节（中文版 P496，英文版 P724），提到了这样一段话，介绍了 waitpid 函数的默认行为，以及退出状态的检查方法
-    > （更改默认行为）WNOHANG|WUNTRACED：立即返回。如果等待集里面没有子进程已经终止，那么返回 0；否则，返回其中一个已终止子进程的 PID。
-    > （检查回收子进程的返回状态）WIFEXITED(status)：如果子进程正常退出，即通过调用 exit 或者 return，则返回真。
-  Writeup 中也提到 WNOHANG|WUNTRACED 或许会有用。
-  前一个更改默认行为的部分对应了 waitpid 的第三个参数，后一个检查用于确定是否有个子进程真的退出了（而非没有子进程终止，waitpid 返回了 0）
+    for (cmd = args; *cmd != NULL && strcmp(*cmd, "--") != 0; cmd++)
+        ;
+    if (*cmd == NULL || *++cmd == NULL)
+    {
+        printf("after: usage: after [-s] <job> ... -- <command>\n");
+        return;
+    }
 
-trace06.txt – 将 SIGINT 信号发送到前台任务。
-  在 tshref 中，终止进程后还会输出一行提示信息，由于这也算是子进程结束了，这部分也是在 sigchld_handler 中处理的。将函数修改为如下的样子即可。
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);                                       // 防止前置任务在解析过程中被回收
 
-trace08.txt – 将 SIGTSTP 信号只发送给前台任务。
-  注意这里额外地要将工作的状态改为停止（对应上文 addjob 说明处的三种状态类型）
-*/
-void sigchld_handler(int sig)
-{
-    pid_t pid;
-    int status;
-    while((pid=waitpid(-1,&status,WNOHANG|WUNTRACED))>0)                        // 如果子进程是僵尸进程，则无需等待
+    ndeps = parsejobs(argv[0], args, found, NULL, &missing);                    // 每个任务只出现一次，否则永远等不到第二次结束
+    if (ndeps < 0 || missing > 0)                                               // 不存在的前置任务永远不会结束
     {
-        if(WIFEXITED(status))
-        {
-            deletejob(jobs,pid);                                                // 删除 job
-        }
-
-        // trace06 add
-        if(WIFSIGNALED(status))
-        {
-            printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, WTERMSIG(status));
-            deletejob(jobs,pid); // remove pid from job list
-        }
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
 
-        // trace08 add
-        if (WIFSTOPPED(status)) // SIGTSTP, etc.
+    /* The job's command line is what follows "--"; it always runs in the background */
+    for (n = 0, dst = cmdline; cmd[n] != NULL; n++)
+    {
+        if (dst + strlen(cmd[n]) + 8 > cmdline + MAXLINE)                       // 通配符展开后可能远超 MAXLINE
         {
-            printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
-            struct job_t *job = getjobpid(jobs, pid);
-            job->state = ST;                                                    // 将工作的状态改为停止
+            dst = putstr(dst, "... ");
+            break;
         }
+        dst = putstr(putstr(dst, cmd[n]), " ");
     }
+    strcpy(dst, "&\n");
 
-    // trace06 add
-    if (pid < 0 && errno != ECHILD)
+    if (argvsize(cmd) > MAXLINE)                                                // 排队的命令要放进 argbuf
+        printf("%s: Argument list too long to queue\n", cmd[0]);
+    else if ((jid = addjob(jobs, 0, WT, cmdline)) != 0)
     {
-        unix_error("waitpid error");
+        job = getjobjid(jobs, jid);
+        for (n = 0; n < ndeps; n++)
+            job->deps[n] = found[n]->jid;
+        job->ndeps = ndeps;
+        job->onsuccess = onsuccess;
+        saveargv(job, cmd);
+
+        launchready(jobs);                                                      // 没有前置任务时立即启动
+        if (job->state == WT)
+            printf("[%d] (-) %s", job->jid, job->cmdline);
     }
 
+    sigprocmask(SIG_SETMASK, &prev, NULL);
     return;
 }
 
 /*
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.
+ * do_wait - Execute the builtin wait command
+ *
+ *     wait [-n] [-t <ms>] [<job> ...]
+ *
+ * Block until every listed job (default: every running or waiting
+ * job) has finished, or with -n until any one has, and report how
+ * they ended.  Jobs that finished shortly before are found in donelog,
+ * which the reap path fills in, so no status is lost to the race with
+ * sigchld_handler.  -t gives up after <ms> milliseconds; ctrl-c too.
  */
-/*
-trace06.txt – 将 SIGINT 信号发送到前台任务。
-  我们需要实现 SIGINT 信号的处理例程。这里使用 -pid 是为了将整个进程组的进程全部干掉。
-
-trace07.txt – 将 SIGINT 信号只发送到前台任务。
-  其实单论测试的话，上个 trace 的程序现在也可以直接用。但测试用例没有测试没有前台任务的情况，为了让程序更完善，还是要做一处修改。
-  在 sigint_handler 中。需要判断是否存在前台任务，如果没有，就不需要做任何事。
-  这样，在什么都没运行的时候按下 Ctrl+C，tsh 就不会直接挂掉，什么都输不进去。在没有前台任务的情况下，fgpid 会返回 0，我们可以利用这个特性。
-*/
-void sigint_handler(int sig)
+void do_wait(char **argv)
 {
-    pid_t pid = fgpid(jobs);                                                    // 获取前台进程pid
+    struct { int jid; pid_t pid; unsigned int since; int done; } w[MAXARGS];
+    unsigned int oldest;
+    int i, n = 0, any = 0, ndonenow, ok = 1, isjid, numid, hit;
+    long long timeout = -1, deadline = 0, left;
+    char *end;
+    struct job_t *job;
+    struct done_t *d;
+    struct timespec ts;
+    sigset_t mask, prev;
 
-    // trace07 add
-    if (pid != 0)                                                               // 防止无前台时tsh被干掉
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);                                       // 目标任务的状态在此期间只能由我们来回收
 
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++)
     {
-        if (kill(-pid, SIGINT) < 0)                                             // 尝试将整个进程组终止
+        if (strcmp(argv[i], "-n") == 0)
+            any = 1;
+        else if (strcmp(argv[i], "-t") == 0 && argv[i+1] != NULL)
         {
-            unix_error("sigint error");
+            timeout = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || timeout < 0)
+                ok = 0;
         }
+        else
+            ok = 0;
+    }
+    if (!ok)
+    {
+        printf("wait: usage: wait [-n] [-t <ms>] [<job> ...]\n");
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
     }
-    return;
-}
 
-/*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.
- */
-/*
-trace08.txt – 将 SIGTSTP 信号只发送给前台任务。
-  SIGTSTP 对应的是 Ctrl+Z。实现方法很像上两个 trace 的方法，只需改 sigtstp_handler 和 sigchld_handler 就行了。
-*/
-void sigtstp_handler(int sig)
-{
-    pid_t pid = fgpid(jobs);
-    if (pid != 0)
+    if (argv[i] == NULL)                                                        // 没有参数就等所有运行中和排队中的任务
+    {
+        for (job = jobs; job < jobs + MAXJOBS; job++)
+            if (job->state == BG || job->state == WT)
+            {
+                w[n].jid = job->jid;
+                w[n].pid = job->pid;
+                w[n].done = 0;
+                w[n++].since = ndone;
+            }
+    }
+    for (; argv[i] != NULL; i++)
     {
-        if (kill(-pid, SIGTSTP) < 0)
+        if ((isjid = parseid(argv[0], argv[i], &numid)) < 0)                    // 和 kill、fg 一样，格式不对就什么都不等
         {
-            unix_error("sigtstp error");
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            return;
         }
-    }
+        w[n].since = ndone;
+        w[n].done = 0;
+        if ((job = isjid ? getjobjid(jobs, numid) : getjobpid(jobs, numid)) != NULL)
+        {
+            w[n].jid = job->jid;
+            w[n++].pid = job->pid;
+            continue;
+        }
+        /* Not in the job list: maybe it has just finished */
+        oldest = ndone > MAXDONE ? ndone - MAXDONE : 0;
+        w[n].jid = isjid ? numid : 0;
+        w[n].pid = isjid ? 0 : numid;
+        for (hit = 0, w[n].since = ndone; !hit && w[n].since > oldest; )        // 从最新的往回找，JID 会被重用
+        {
+            d = &donelog[--w[n].since % MAXDONE];
+            hit = w[n].pid ? d->pid == w[n].pid : d->jid == w[n].jid;
+        }
+        if (hit)
+            n++;
+        else
+            parsejobid(argv[0], argv[i]);                                       // 打印 No such job/process
+    }
+
+    if (timeout >= 0)
+        deadline = nsnow() + timeout * 1000000;
+    interrupted = 0;
+    for (;;)
+    {
+        /* Check each target against what the reap path has logged */
+        for (i = 0, ndonenow = 0; i < n; i++)
+        {
+            while (!w[i].done && w[i].since < ndone)
+            {
+                d = &donelog[w[i].since % MAXDONE];
+                if (w[i].pid ? d->pid == w[i].pid : d->jid == w[i].jid)
+                    w[i].done = 1;                                              // since 停在它的记录上
+                else
+                    w[i].since++;
+            }
+            ndonenow += w[i].done;
+        }
+        if (ndonenow == n || (any && ndonenow > 0) || interrupted)
+            break;
+
+        if (timeout < 0)
+        {
+            sigsuspend(&prev);                                                  // SIGCHLD 处理程序运行后会返回
+            continue;
+        }
+        if ((left = deadline - nsnow()) <= 0)
+            break;
+        ts.tv_sec = left / 1000000000;
+        ts.tv_nsec = left % 1000000000;
+        if (sigtimedwait(&mask, NULL, &ts) == SIGCHLD)                          // 信号被取走了，处理程序不会运行，自己回收
+            sigchld_handler(SIGCHLD);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (!w[i].done)
+            continue;
+        d = &donelog[w[i].since % MAXDONE];
+        if (d->status == -1)
+            printf("[%d] (-) Cancelled\n", d->jid);
+        else if (WIFEXITED(d->status))
+            printf("[%d] (%d) Exit %d\n", d->jid, d->pid, WEXITSTATUS(d->status));
+        else
+            printf("[%d] (%d) Signal %d\n", d->jid, d->pid, WTERMSIG(d->status));
+        if (any)
+            break;
+    }
+    if (ndonenow < n && !(any && ndonenow > 0))
+        printf(interrupted ? "wait: interrupted\n" : "wait: timed out\n");
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return;
+}
+
+/*
+ * do_timeout - Execute the builtin timeout command
+ *
+ *     timeout [-k <grace>] [-c <cpu>] <duration> <job> ...
+ *     timeout [-k <grace>] [-c <cpu>] <duration> -- <command> [&]
+ *
+ * Give each job <duration> of wall-clock time from now, after which
+ * its process group gets SIGTERM and, <grace> later (default 5s),
+ * SIGKILL.  -c caps CPU time the same way via RLIMIT_CPU: for each
+ * process of a command started by the second form (or of a job still
+ * waiting to start), but for a running job only its leader's, as the
+ * processes it has already forked keep their own limits.  Durations
+ * take an ms, s, m or h suffix.  eval handles the second form.
+ */
+void do_timeout(char **argv)
+{
+    struct limit_t lim;
+    struct job_t *found[MAXJOBS];
+    struct rlimit rl;
+    sigset_t mask, prev;
+    int i, n;
+
+    if ((i = parselimits(argv, &lim)) == 0)
+        return;
+    if (argv[i] == NULL)
+    {
+        printf("timeout: no job given\n");
+        return;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    n = parsejobs(argv[0], argv + i, found, NULL, NULL);
+    for (i = 0; i < n; i++)
+    {
+        found[i]->lim = lim;
+        if (found[i]->state == WT)                                              // 排队中的任务启动时再生效
+            continue;
+        if (cpurlimit(&lim, &rl))                                               // 已经在运行的任务只能限制组长
+            prlimit(found[i]->pid, RLIMIT_CPU, &rl, NULL);
+        setlimits(found[i]);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return;
+}
+
+/*
+ * do_kill - Execute the builtin kill command
+ *
+ *     kill [-<signal>] <job> ...
+ *
+ * Send signal (a number or a name like TERM or SIGTERM; default TERM)
+ * to the process group of every job given.  Jobs are resolved in one
+ * pass by parsejobs, so %1-%200 or %stopped costs one kill(2) per job
+ * rather than a fork of /bin/kill.  Reports how many were signaled.
+ */
+void do_kill(char **argv)
+{
+    struct job_t *found[MAXJOBS];
+    char **args = argv + 1;
+    int i, n, rc, sig = SIGTERM, ok = 0, missing;
+    sigset_t mask, prev;
+
+    if (*args != NULL && (*args)[0] == '-')
+    {
+        if ((sig = parsesig(*args + 1)) < 0)
+        {
+            printf("kill: %s: invalid signal\n", *args + 1);
+            return;
+        }
+        args++;
+    }
+    if (*args == NULL)
+    {
+        printf("kill: usage: kill [-<signal>] <job> ...\n");
+        return;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if ((n = parsejobs(argv[0], args, found, NULL, &missing)) < 0)
+    {
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (found[i]->state == WT)                                              // 排队中的任务还没有进程
+            continue;
+        if (sig == SIGCONT && found[i]->state == ST)                            // 没有 WCONTINUED，自己改状态；和 bg 一样要先拿到令牌
+        {
+            if (resumebg(found[i]))
+                ok++;
+            else
+                printf("%%%d: Waiting for a job slot\n", found[i]->jid);
+            continue;
+        }
+        if ((rc = signaljob(found[i], sig)) < 0)
+            continue;
+        ok++;
+        if (rc == 1 && found[i]->state != ST)                                   // 冻结不会产生 SIGCHLD
+            markfrozen(found[i]);
+    }
+    printf("kill: signaled %d of %d jobs\n", ok, n + missing);                  // 先报告，再放进 SIGCHLD，输出顺序固定
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return;
+}
+
+/*
+ * do_history - Execute the builtin history command
+ *
+ *     history [-n <n>] [-p <prefix>] [-s <substring>]
+ *
+ * List the commands in the history file, or only those starting with
+ * prefix or containing substring, numbered from the oldest; -n keeps
+ * the last n.  Commands other shells have appended since the last
+ * call are picked up first.
+ */
+void do_history(char **argv)
+{
+    int i, n, last = -1, ok = 1, *found = NULL;
+    char *prefix = NULL, *substr = NULL, *end;
+
+    for (i = 1; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && argv[i+1] != NULL)
+        {
+            last = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || last < 0)
+                ok = 0;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && argv[i+1] != NULL)
+            prefix = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && argv[i+1] != NULL)
+            substr = argv[++i];
+        else
+            ok = 0;
+    }
+    if (!ok || (prefix != NULL && substr != NULL))
+    {
+        printf("history: usage: history [-n <n>] [-p <prefix> | -s <substring>]\n");
+        return;
+    }
+    if (hist_fd < 0)
+    {
+        printf("history: no history file\n");
+        return;
+    }
+
+    n = histsync();                                                             // 别的 shell 可能也追加了
+    if (n > 0 && (prefix != NULL || substr != NULL))
+    {
+        if ((found = malloc(n * sizeof(int))) == NULL)
+        {
+            printf("history: %s\n", strerror(errno));
+            return;
+        }
+        n = prefix != NULL ? histprefix(prefix, found) : histsearch(substr, found);
+    }
+    for (i = (last >= 0 && last < n) ? n - last : 0; i < n; i++)
+    {
+        int r = found != NULL ? found[i] : i;
+        printf("%5d  %.*s\n", r + 1, histlen(r), hist_map + hist_off[r]);
+    }
+    free(found);
+    return;
+}
+
+/*
+ * do_export - Execute the builtin export command
+ *
+ *     export [<name>[=<value>] ...]
+ *
+ * Set each variable, if a value is given, and pass it in the
+ * environment of every command started from now on.  With no
+ * arguments, list the exported variables.
+ */
+void do_export(char **argv)
+{
+    int i, n, pos;
+
+    if (argv[1] == NULL)
+    {
+        for (i = 0; i < nvars; i++)
+            if (vars[i].exported)
+                printf("export %s\n", vars[i].str);
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++)
+    {
+        n = strlen(argv[i]);
+        if (assignment(argv[i]))
+            setvar(argv[i], 1);
+        else if (findvar(argv[i], n, &pos))                                     // 只给名字：导出现有的值
+        {
+            if (!vars[pos].exported)
+            {
+                vars[pos].exported = 1;
+                buildenv();
+            }
+        }
+        else if (n < MAXLINE - 1 && assignment(strcat(strcpy(sbuf, argv[i]), "=")))  // 还没有就是空值
+            setvar(sbuf, 1);
+        else
+            printf("export: %s: not a valid identifier\n", argv[i]);
+    }
+    return;
+}
+
+/*
+ * do_unset - Execute the builtin unset command
+ *
+ *     unset <name> ...
+ */
+void do_unset(char **argv)
+{
+    int i;
+
+    for (i = 1; argv[i] != NULL; i++)
+        unsetvar(argv[i]);
+    return;
+}
+
+/*
+ * do_apply - Execute the builtin apply command
+ *
+ *     apply [-n <n>] <command> ... -- <pattern> ...
+ *
+ * Run command in the background on the paths matching the patterns,
+ * n at a time (default: as many as fit in argv), with as many of these
+ * jobs at once as there are free job slots and jobserver tokens.  Each
+ * batch starts as soon as the directory scan has found it, so the
+ * matches are never gathered into one huge argv and a pattern may
+ * match millions of files.  Quote the patterns ('*.log') so that they
+ * reach apply unexpanded.  Returns once the last batch has started;
+ * ctrl-c stops it early.
+ */
+void do_apply(char **argv)
+{
+    static struct apply_t ap;                                                   // 32K 的缓冲区，不放在栈上
+    int i, ok = 1;
+    char *end;
+
+    ap.max = MAXARGS;
+    for (i = 1; argv[i] != NULL && strcmp(argv[i], "-n") == 0; i += 2)
+    {
+        if (argv[i+1] == NULL)                                                  // 不能越过 argv 末尾的 NULL
+        {
+            ok = 0;
+            break;
+        }
+        if ((ap.max = strtol(argv[i+1], &end, 10)) < 1 || *end != '\0')
+            ok = 0;
+    }
+    for (ap.ncmd = 0; ok && argv[i] != NULL && strcmp(argv[i], "--") != 0; i++)
+        ap.argv[ap.ncmd++] = argv[i];
+    if (!ok || ap.ncmd == 0 || argv[i] == NULL || argv[i+1] == NULL)
+    {
+        printf("apply: usage: apply [-n <n>] <command> ... -- <pattern> ...\n");
+        return;
+    }
+    if (ap.max > MAXARGS - 1 - ap.ncmd)                                         // 命令本身也占 argv
+        ap.max = MAXARGS - 1 - ap.ncmd;
+
+    ap.argc = ap.ncmd;
+    ap.next = ap.buf;
+    ap.files = ap.jobs = 0;
+    interrupted = 0;
+    for (i++; ok && argv[i] != NULL && !interrupted; i++)
+        ok = globrun(argv[i], applyfound, &ap) == 0;                            // 被 ctrl-c 打断或者没有空位了
+    if (ok && !interrupted)
+        ok = applylaunch(&ap) == 0;                                             // 最后不满的一批
+
+    printf("apply: %s%d files in %d jobs\n", interrupted ? "interrupted, " : ok ? "" : "stopped, ", ap.files, ap.jobs);
+    return;
+}
+
+/*
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+/*
+trace05.txt – 处理 jobs 内置命令。
+  Writeup 提示
+    > 实验有一个棘手的部分，是决定 waitfg 和 sigchld 处理函数之间的工作分配。我们推荐以下方法：
+    > – 在 waitfg 中，用一个死循环包裹 sleep 函数。
+    > – 在 sigchild_handler 中，调用且仅调用一次 waitpid。
+  后来为了能追踪 waitfg 的每次唤醒，改成了 CS:APP 8.5.7 的 sigsuspend 写法：
+  阻断 SIGCHLD 后检查条件，再原子地解除阻断并挂起，不会错过信号，也不再空转。
+*/
+void waitfg(pid_t pid)
+{
+    sigset_t mask, prev;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    while (pid == fgpid(jobs))
+    {
+        sigsuspend(&prev);                                                      // 等到有信号处理程序运行过再检查
+        TRACE_MARK("waitfg wakeup");
+    }
+    taketerminal(pid);                                                          // 任务停止或结束了，收回终端
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return;
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/*
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.
+ */
+/*
+trace05.txt – 处理 jobs 内置命令。
+  涉及到对 waitpid 函数的更深入理解，在 CSAPP 8.4.3 节（中文版 P496，英文版 P724），提到了这样一段话，介绍了 waitpid 函数的默认行为，以及退出状态的检查方法
+    > （更改默认行为）WNOHANG|WUNTRACED：立即返回。如果等待集里面没有子进程已经终止，那么返回 0；否则，返回其中一个已终止子进程的 PID。
+    > （检查回收子进程的返回状态）WIFEXITED(status)：如果子进程正常退出，即通过调用 exit 或者 return，则返回真。
+  Writeup 中也提到 WNOHANG|WUNTRACED 或许会有用。
+  前一个更改默认行为的部分对应了 waitpid 的第三个参数，后一个检查用于确定是否有个子进程真的退出了（而非没有子进程终止，waitpid 返回了 0）
+
+trace06.txt – 将 SIGINT 信号发送到前台任务。
+  在 tshref 中，终止进程后还会输出一行提示信息，由于这也算是子进程结束了，这部分也是在 sigchld_handler 中处理的。将函数修改为如下的样子即可。
+
+trace08.txt – 将 SIGTSTP 信号只发送给前台任务。
+  注意这里额外地要将工作的状态改为停止（对应上文 addjob 说明处的三种状态类型）
+*/
+void sigchld_handler(int sig)
+{
+    pid_t pid;
+    int status;
+    sigset_t mask, prev;
+
+    TRACE_BEGIN("sigchld_handler");
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, &prev);                                       // 不能在我们改任务表时被计时轮打断
+    while((pid=waitpid(-1,&status,WNOHANG|WUNTRACED))>0)                        // 如果子进程是僵尸进程，则无需等待
+    {
+        if(WIFEXITED(status))
+        {
+            jobevent("exit", getjobpid(jobs, pid), pid, "status", WEXITSTATUS(status));
+            jobdone(getjobpid(jobs, pid), status);                              // 释放等待它的任务
+            deletejob(jobs,pid);                                                // 删除 job
+        }
+
+        // trace06 add
+        if(WIFSIGNALED(status))
+        {
+            printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, WTERMSIG(status));
+            jobevent("signal", getjobpid(jobs, pid), pid, "signal", WTERMSIG(status));
+            jobdone(getjobpid(jobs, pid), status);
+            deletejob(jobs,pid); // remove pid from job list
+        }
+
+        // trace08 add
+        if (WIFSTOPPED(status)) // SIGTSTP, etc.
+        {
+            printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
+            struct job_t *job = getjobpid(jobs, pid);
+            job->state = ST;                                                    // 将工作的状态改为停止
+            jobevent("stop", job, pid, "signal", WSTOPSIG(status));
+            cgfreeze(job, 1);                                                   // 离开了进程组或不理睬信号的进程也一起停下
+        }
+    }
+
+    // trace06 add
+    if (pid < 0 && errno != ECHILD)
+    {
+        unix_error("waitpid error");
+    }
+
+    launchready(jobs);                                                          // 前置任务都结束了的任务现在启动
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    TRACE_END("sigchld_handler");
+    return;
+}
+
+/*
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.
+ */
+/*
+trace06.txt – 将 SIGINT 信号发送到前台任务。
+  我们需要实现 SIGINT 信号的处理例程。这里使用 -pid 是为了将整个进程组的进程全部干掉。
+
+trace07.txt – 将 SIGINT 信号只发送到前台任务。
+  其实单论测试的话，上个 trace 的程序现在也可以直接用。但测试用例没有测试没有前台任务的情况，为了让程序更完善，还是要做一处修改。
+  在 sigint_handler 中。需要判断是否存在前台任务，如果没有，就不需要做任何事。
+  这样，在什么都没运行的时候按下 Ctrl+C，tsh 就不会直接挂掉，什么都输不进去。在没有前台任务的情况下，fgpid 会返回 0，我们可以利用这个特性。
+*/
+void sigint_handler(int sig)
+{
+    pid_t pid;
+
+    TRACE_BEGIN("sigint_handler");
+    pid = fgpid(jobs);                                                          // 获取前台进程pid
+
+    // trace07 add
+    if (pid != 0)                                                               // 防止无前台时tsh被干掉
+
+    {
+        if (kill(-pid, SIGINT) < 0)                                             // 尝试将整个进程组终止
+        {
+            unix_error("sigint error");
+        }
+    }
+    else
+    {
+        interrupted = 1;                                                        // 让 wait 之类的阻塞内置命令返回
+    }
+    TRACE_END("sigint_handler");
+    return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.
+ */
+/*
+trace08.txt – 将 SIGTSTP 信号只发送给前台任务。
+  SIGTSTP 对应的是 Ctrl+Z。实现方法很像上两个 trace 的方法，只需改 sigtstp_handler 和 sigchld_handler 就行了。
+*/
+void sigtstp_handler(int sig)
+{
+    pid_t pid;
+    int rc;
+
+    TRACE_BEGIN("sigtstp_handler");
+    pid = fgpid(jobs);
+    if (pid != 0)
+    {
+        if ((rc = signaljob(getjobpid(jobs, pid), SIGTSTP)) < 0)                // 有 cgroup 时是冻结整棵进程树
+        {
+            unix_error("sigtstp error");
+        }
+        if (rc == 1)                                                            // 冻结不会产生 SIGCHLD，自己改状态
+        {
+            markfrozen(getjobpid(jobs, pid));
+        }
+    }
+    TRACE_END("sigtstp_handler");
+    return;
+}
+
+/*
+ * sigalrm_handler - The interval timer ticks every TICK_MS while any
+ *     job timeout is armed.  Advance the timer wheel one slot and fire
+ *     the timers that are due: SIGTERM first, SIGKILL after the grace
+ *     period if the job is still around.
+ */
+void sigalrm_handler(int sig)
+{
+    struct job_t *job, *next;
+    int stage, olderrno = errno;
+    sigset_t mask, prev;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    wheelpos = (wheelpos + 1) & (WHEELSIZE-1);
+    for (job = wheel[wheelpos]; job != NULL; job = next)
+    {
+        next = job->tnext;
+        if (job->trounds > 0)                                                   // 还要再转几圈
+        {
+            job->trounds--;
+            continue;
+        }
+        stage = job->tstage;
+        disarmtimer(job);
+        if (stage == 1)
+        {
+            printf("Job [%d] (%d) timed out\n", job->jid, job->pid);
+            jobevent("timeout", job, job->pid, NULL, 0);
+            kill(-(job->pid), SIGTERM);
+            signaljob(job, SIGCONT);                                            // 停止（或 -c 下冻结）的任务要继续运行才能处理 SIGTERM
+            if (job->lim.grace > 0)
+                armtimer(job, job->lim.grace, 2);
+        }
+        else
+        {
+            kill(-(job->pid), SIGKILL);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    errno = olderrno;
+}
+
+/*
+trace11.txt – 将 SIGINT 信号发送给前台进程集里的每个进程
+trace12.txt – 将 SIGTSTP 信号发送给前台进程集里的每个进程
+trace13.txt – 将进程集里的每个停止的进程重启
+trace14.txt – 简单的错误处理
+trace15.txt – 全都混到一起
+trace16.txt – 测试 shell 是否能够处理来自其他进程（而不是终端）的 SIGTSTP 和 SIGINT 信号
+*/
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->cmdline[0] = '\0';
+    job->ndeps = 0;
+    job->onsuccess = 0;
+    job->argv[0] = NULL;
+    job->token = NOTOKEN;
+    job->resume = 0;
+    job->hastmodes = 0;
+    job->lim.wall = job->lim.cpu = 0;
+    job->tstage = 0;            /* jobdone has disarmed its timer */
+    job->cgfreeze = job->cgevents = -1; /* and removed its cgroup */
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	clearjob(&jobs[i]);
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct job_t *jobs)
+{
+    int i, max=0;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid > max)
+	    max = jobs[i].jid;
+    return max;
+}
+
+/*
+ * addjob - Add a job to the job list, returning its JID (0 on failure).
+ *    It gets the lowest JID no live job holds, so JIDs stay unique for
+ *    after, wait and %lo-hi.  Only a WT job, which has no process yet,
+ *    may have pid 0.
+ */
+int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
+{
+    int i, jid;
+    char taken[MAXJOBS+1];
+
+    if (pid < 1 && state != WT)
+	return 0;
+
+    TRACE_BEGIN("addjob");
+    memset(taken, 0, sizeof(taken));
+    for (i = 0; i < MAXJOBS; i++)
+	taken[jobs[i].jid] = 1;
+    for (jid = 1; jid <= MAXJOBS && taken[jid]; jid++)
+	;
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].jid == 0) {
+	    jobs[i].pid = pid;
+	    jobs[i].state = state;
+	    jobs[i].jid = jid;
+	    strcpy(jobs[i].cmdline, cmdline);
+	    jobs[i].start = nsnow();
+	    if (state == WT)
+		jobevent("queue", &jobs[i], pid, NULL, 0);
+	    else
+		jobevent("spawn", &jobs[i], pid, "fg", state == FG);
+  	    if(verbose){
+	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+            }
+	    TRACE_END("addjob");
+            return jobs[i].jid;
+	}
+    }
+    printf("Tried to create too many jobs\n");
+    TRACE_END("addjob");
+    return 0;
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct job_t *jobs, pid_t pid)
+{
+    int i;
+
+    if (pid < 1)
+	return 0;
+
+    TRACE_BEGIN("deletejob");
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid == pid) {
+	    jobevent("reap", &jobs[i], pid, "run_ns", nsnow() - jobs[i].start);
+	    clearjob(&jobs[i]);
+	    TRACE_END("deletejob");
+	    return 1;
+	}
+    }
+    TRACE_END("deletejob");
+    return 0;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].state == FG)
+	    return jobs[i].pid;
+    return 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
+    int i;
+
+    if (pid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid == pid)
+	    return &jobs[i];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct job_t *jobs, int jid)
+{
+    int i;
+
+    if (jid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid == jid)
+	    return &jobs[i];
+    return NULL;
+}
+
+/*
+ * parseid - Parse the PID or %jobid argument of builtin cmd into
+ *    *numid.  Returns 1 for a %jobid, 0 for a PID, or -1 after printing
+ *    the usual diagnostic if it is malformed.
+ */
+int parseid(char *cmd, char *id, int *numid)
+{
+    char *end;                                                                  // *end 指向被转换的最后一个数字的下一个字符
+    int isjid = (id[0] == '%');
+
+    id += isjid;                                                                // JID 要跳过 %，让指针指向第一个数字
+    *numid = strtol(id, &end, 10);                                              // 使用 strtol 功能将其从字符串转为数字。
+    // 正常情况下，JID/PID 并不应该包含除开头 % 号外的字符，所以 end 指向的应该是表示字符串结尾的 \0。
+    if (end == id || *end != '\0')
+    // 不能非数字字符（不然 end 将不是指向 \0，而是指向到最后一个不能转换的字符），也不能一个数字都没有
+    {
+        printf("%s: argument must be a PID or %%jobid\n", cmd);
+        return -1;
+    }
+    return isjid;
+}
+
+/*
+ * parsejobid - Map the PID or %jobid argument of builtin cmd to its
+ *    job, printing the usual diagnostic and returning NULL if there
+ *    is no such job
+ */
+struct job_t *parsejobid(char *cmd, char *id)
+{
+    struct job_t *job = NULL;
+    int numid, isjid;
+
+    if ((isjid = parseid(cmd, id, &numid)) < 0)                                 // 格式不对，出错信息已在其中打印
+        return NULL;
+    if (isjid)                                                                  // this is a job (JID)
+    {
+        job = getjobjid(jobs, numid);                                           // 获取 job
+        if (job == NULL)                                                        // 检查是否存在
+            printf("%%%d: No such job\n", numid);
+    }
+    else                                                                        // this is a process (PID)
+    {
+        job = getjobpid(jobs, numid); // try to get proc
+        if (job == NULL)
+            printf("(%d): No such process\n", numid);
+    }
+    return job;
+}
+
+/*
+ * parsejobs - Resolve the job arguments of builtin cmd, from args up
+ *    to NULL or "--", into found[] in a single pass over the job list.
+ *    Besides a PID or %jobid, an argument can be a range %lo-%hi (or
+ *    %lo-hi), or %running, %stopped or %waiting for every job in that
+ *    state.  Each job is found at most once; if argno is not NULL,
+ *    argno[k] is the index of the last argument found[k] matched.
+ *    A PID or %jobid that names no job is reported and counted in
+ *    *missing (if not NULL), while a range or state that matches
+ *    nothing is not an error.  Returns how many were found, or -1
+ *    after reporting every argument that is malformed.
+ */
+int parsejobs(char *cmd, char **args, struct job_t **found, int *argno, int *missing)
+{
+    struct { int kind, lo, hi, hit; } sel[MAXARGS];  /* kind: 0 PID, 1 JIDs, 2 state */
+    int i, j, nsel, n = 0, bad = 0, nmissing = 0;
+    char *id, *num, *end;
+
+    for (nsel = 0; args[nsel] != NULL && strcmp(args[nsel], "--") != 0; nsel++) {
+	id = args[nsel];
+	sel[nsel].hit = 0;
+	sel[nsel].kind = 2;
+	if (strcmp(id, "%running") == 0)
+	    sel[nsel].lo = BG;
+	else if (strcmp(id, "%stopped") == 0)
+	    sel[nsel].lo = ST;
+	else if (strcmp(id, "%waiting") == 0)
+	    sel[nsel].lo = WT;
+	else {
+	    sel[nsel].kind = (id[0] == '%');
+	    num = id + sel[nsel].kind;
+	    sel[nsel].lo = sel[nsel].hi = strtol(num, &end, 10);
+	    if (sel[nsel].kind == 1 && end != num && *end == '-') {
+		num = end + 1 + (end[1] == '%');
+		sel[nsel].hi = strtol(num, &end, 10);
+	    }
+	    if (end == num || *end != '\0') {
+		printf("%s: argument must be a PID or %%jobid\n", cmd);
+		bad = 1;
+	    }
+	    else if (sel[nsel].lo > sel[nsel].hi) {
+		printf("%s: %s: empty job range\n", cmd, id);
+		bad = 1;
+	    }
+	}
+    }
+    if (bad)
+	return -1;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	struct job_t *job = &jobs[i];
+	int match = -1;
+
+	if (job->jid == 0)
+	    continue;
+	for (j = 0; j < nsel; j++)
+	    if ((sel[j].kind == 0 && job->pid != 0 && job->pid == sel[j].lo) ||
+		(sel[j].kind == 1 && job->jid >= sel[j].lo && job->jid <= sel[j].hi) ||
+		(sel[j].kind == 2 && job->state == sel[j].lo)) {
+		sel[j].hit = 1;
+		match = j;
+	    }
+	if (match < 0)
+	    continue;
+	if (argno != NULL)
+	    argno[n] = match;
+	found[n++] = job;
+    }
+
+    for (j = 0; j < nsel; j++) {
+	if (sel[j].hit)
+	    continue;
+	if (sel[j].kind == 0) {
+	    printf("(%d): No such process\n", sel[j].lo);
+	    nmissing++;
+	}
+	else if (sel[j].kind == 1 && sel[j].lo == sel[j].hi) {
+	    printf("%%%d: No such job\n", sel[j].lo);
+	    nmissing++;
+	}
+    }
+    if (missing != NULL)
+	*missing = nmissing;
+    return n;
+}
+
+/* parsesig - Map a signal number or name (KILL or SIGKILL) to its number, -1 if unknown */
+int parsesig(char *name)
+{
+    static struct { char *name; int sig; } sigs[] = {
+	{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+	{"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+	{"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+	{"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"XCPU", SIGXCPU}, {"WINCH", SIGWINCH},
+    };
+    char *end;
+    int i, sig;
+
+    if (isdigit((unsigned char)name[0])) {
+	sig = strtol(name, &end, 10);
+	return (*end == '\0' && sig >= 0 && sig < NSIG) ? sig : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0)
+	name += 3;
+    for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++)
+	if (strcmp(name, sigs[i].name) == 0)
+	    return sigs[i].sig;
+    return -1;
+}
+
+/*
+ * signaljob - Send sig to every process in job's process group.  If
+ *    the job has a cgroup (-c), SIGTSTP and SIGSTOP freeze it instead,
+ *    and SIGCONT thaws it before being sent.  Returns 1 if the job was
+ *    frozen, 0 if signaled, -1 on error.
+ */
+int signaljob(struct job_t *job, int sig)
+{
+    if ((sig == SIGTSTP || sig == SIGSTOP) && cgfreeze(job, 1) == 0)
+	return 1;
+    if (sig == SIGCONT)
+	cgfreeze(job, 0);
+    return kill(-(job->pid), sig) < 0 ? -1 : 0;
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid)
+{
+    int i;
+
+    if (pid < 1)
+	return 0;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid == pid) {
+            return jobs[i].jid;
+        }
+    return 0;
+}
+
+/*
+ * jobdone - Job has exited or been killed: release the WT jobs that
+ *    were waiting on it.  Those queued with "after -s" are cancelled
+ *    instead unless it exited with status 0, which in turn releases
+ *    (or cancels) whatever was waiting on them.
+ */
+void jobdone(struct job_t *job, int status)
+{
+    int i, j;
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    if (job == NULL)
+	return;
+    puttoken(job->token);
+    job->token = NOTOKEN;
+    disarmtimer(job);
+    cgremove(job);
+
+    /* Remember how it ended for the wait builtin */
+    donelog[ndone % MAXDONE].pid = job->pid;
+    donelog[ndone % MAXDONE].jid = job->jid;
+    donelog[ndone % MAXDONE].status = job->state == WT ? -1 : status;
+    ndone++;
+    for (i = 0; i < MAXJOBS; i++) {
+	struct job_t *w = &jobs[i];
+
+	if (w->state != WT)
+	    continue;
+	for (j = 0; j < w->ndeps && w->deps[j] != job->jid; j++)
+	    ;
+	if (j == w->ndeps)
+	    continue;
+	w->deps[j] = w->deps[--w->ndeps];
+	if (w->onsuccess && !ok) {
+	    printf("Job [%d] cancelled: %%%d failed\n", w->jid, job->jid);
+	    jobevent("cancel", w, 0, NULL, 0);
+	    jobdone(w, status);
+	    clearjob(w);
+	}
+    }
+}
+
+/* argvsize - Bytes saveargv needs for argv; more than MAXLINE does not fit */
+int argvsize(char **argv)
+{
+    int i, size = 0;
+
+    for (i = 0; argv[i] != NULL; i++)
+	size += strlen(argv[i]) + 1;
+    return size;
+}
+
+/* saveargv - Copy argv into job so that it can be launched later */
+void saveargv(struct job_t *job, char **argv)
+{
+    char *dst = job->argbuf;
+    int i;
+
+    for (i = 0; argv[i] != NULL; i++) {
+	job->argv[i] = strcpy(dst, argv[i]);
+	dst += strlen(dst) + 1;
+    }
+    job->argv[i] = NULL;
+}
+
+/*
+ * launchready - Continue the stopped jobs resumebg queued and start
+ *    every WT job whose prerequisites have all finished, as far as
+ *    jobserver tokens allow.  Called with SIGCHLD blocked or from its
+ *    handler.
+ */
+void launchready(struct job_t *jobs)
+{
+    int i, token;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].state == ST && jobs[i].resume) {
+	    if (resumebg(&jobs[i]) == 0)
+		return;
+	    printf("[%d] (%d) %s", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+	    continue;
+	}
+	if (jobs[i].state != WT || jobs[i].ndeps != 0)
+	    continue;
+	if ((token = gettoken()) == NOTOKEN)
+	    return;
+	jobs[i].token = token;
+	if ((jobs[i].pid = spawn(jobs[i].argv, 0, &jobs[i].lim)) < 0) {
+	    printf("Job [%d] cancelled: fork error\n", jobs[i].jid);
+	    jobs[i].pid = 0;
+	    jobevent("cancel", &jobs[i], 0, NULL, 0);
+	    jobdone(&jobs[i], W_EXITCODE(127, 0));
+	    clearjob(&jobs[i]);
+	    i = -1;             /* that may have released earlier slots */
+	    continue;
+	}
+	jobs[i].state = BG;
+	jobs[i].start = nsnow();
+	cgopen(&jobs[i]);
+	setlimits(&jobs[i]);
+	jobevent("spawn", &jobs[i], jobs[i].pid, "fg", 0);
+	printf("[%d] (%d) %s", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+    }
+}
+
+/*
+ * resumebg - Continue stopped job in the background.  A job keeps its
+ *    jobserver token while stopped; one that has none must take one
+ *    first, and if none is free it stays stopped and is queued for
+ *    launchready.  Returns 1 if it was
+ *    continued, 0 if queued.  Called with SIGCHLD blocked or from its
+ *    handler.
+ */
+int resumebg(struct job_t *job)
+{
+    if (job->token == NOTOKEN && (job->token = gettoken()) == NOTOKEN) {
+	job->resume = 1;
+	return 0;
+    }
+    job->resume = 0;
+    signaljob(job, SIGCONT);
+    job->state = BG;
+    jobevent("cont", job, job->pid, NULL, 0);
+    jobevent("bg", job, job->pid, NULL, 0);
+    return 1;
+}
+
+/* listjobs - Print the job list */
+void listjobs(struct job_t *jobs)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].jid != 0) {
+	    if (jobs[i].pid != 0)
+		printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+	    else
+		printf("[%d] (-) ", jobs[i].jid);
+	    if (cgfrozen(&jobs[i]) == 1)        /* the kernel's word, not ours */
+		printf("Frozen ");
+	    else switch (jobs[i].state) {
+		case BG:
+		    printf("Running ");
+		    break;
+		case FG:
+		    printf("Foreground ");
+		    break;
+		case ST:
+		    printf("Stopped ");
+		    break;
+		case WT:
+		    printf("Waiting ");
+		    break;
+	    default:
+		    printf("listjobs: Internal error: job[%d].state=%d ",
+			   i, jobs[i].state);
+	    }
+	    printf("%s", jobs[i].cmdline);
+	}
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/***************************************************
+ * GNU make jobserver: one pool of job slots shared by
+ * our & jobs and every make -j below us
+ ***************************************************/
+
+/*
+ * openprivate - Reopen inherited fd (a jobserver pipe, the event
+ *    stream) with flags as a file description of our own, so that it
+ *    can be made non-blocking and close-on-exec without changing how
+ *    the other processes sharing it read or write it.
+ */
+int openprivate(int fd, int flags)
+{
+    char path[64];
+    int rfd;
+
+    sprintf(path, "/proc/self/fd/%d", fd);
+    if ((rfd = open(path, flags | O_NONBLOCK | O_CLOEXEC)) < 0) {
+	rfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);   /* no /proc: share it after all */
+	fcntl(rfd, F_SETFL, fcntl(rfd, F_GETFL) | O_NONBLOCK);
+    }
+    return rfd;
+}
+
+/*
+ * initjobserver - Become the jobserver for ntokens job slots: the shell
+ *    holds one implicitly and the rest sit in a pipe advertised to our
+ *    children through MAKEFLAGS
+ */
+void initjobserver(int ntokens)
+{
+    int fds[2], i;
+    char c = '+';
+
+    if (ntokens > MAXTOKENS)
+	ntokens = MAXTOKENS;
+    if (pipe(fds) < 0)
+	unix_error("jobserver pipe error");
+    for (i = 1; i < ntokens; i++)
+	if (write(fds[1], &c, 1) < 0)
+	    unix_error("jobserver write error");
+    js_rfd = openprivate(fds[0], O_RDONLY);
+    js_wfd = fds[1];
+    watchjobserver();
+
+    sprintf(sbuf, " -j%d --jobserver-auth=%d,%d", ntokens, fds[0], fds[1]);
+    setenv("MAKEFLAGS", sbuf, 1);
+}
+
+/*
+ * joinjobserver - If we were started by make (or another tsh -j) that
+ *    passed us a jobserver in MAKEFLAGS, draw our job slots from it.
+ *    Both the "R,W" pipe form and make 4.4's "fifo:PATH" are understood.
+ */
+void joinjobserver(void)
+{
+    char *flags = getenv("MAKEFLAGS"), *auth, *end;
+    int rfd, wfd;
+
+    if (flags == NULL)
+	return;
+    if ((auth = strstr(flags, "--jobserver-auth=")) != NULL)
+	auth += strlen("--jobserver-auth=");
+    else if ((auth = strstr(flags, "--jobserver-fds=")) != NULL)
+	auth += strlen("--jobserver-fds=");
+    else
+	return;
+
+    if (strncmp(auth, "fifo:", 5) == 0) {
+	strncpy(sbuf, auth + 5, MAXLINE - 1);
+	sbuf[MAXLINE - 1] = '\0';
+	sbuf[strcspn(sbuf, " ")] = '\0';
+	js_rfd = open(sbuf, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	js_wfd = open(sbuf, O_WRONLY | O_CLOEXEC);
+    }
+    else {
+	rfd = strtol(auth, &end, 10);
+	if (*end != ',')
+	    return;
+	wfd = strtol(end + 1, &end, 10);
+	if (fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0)
+	    return;             /* make did not pass the pipe down to us */
+	js_rfd = openprivate(rfd, O_RDONLY);
+	js_wfd = wfd;
+    }
+    if (js_rfd < 0 || js_wfd < 0) {
+	close(js_rfd);
+	close(js_wfd);
+	js_rfd = js_wfd = -1;
+	return;
+    }
+    watchjobserver();
+}
+
+/*
+ * watchjobserver - Have the kernel signal us whenever a token is written
+ *    back to the jobserver, also by processes that are not our children,
+ *    so that queued jobs start then rather than at the next SIGCHLD or
+ *    command line.  The signal is SIGCHLD itself: the reap path already
+ *    starts what is queued, and it is blocked wherever the job list is
+ *    being changed.
+ */
+void watchjobserver(void)
+{
+    fcntl(js_rfd, F_SETOWN, getpid());
+    fcntl(js_rfd, F_SETSIG, SIGCHLD);
+    fcntl(js_rfd, F_SETFL, fcntl(js_rfd, F_GETFL) | O_ASYNC);
+}
+
+/*
+ * gettoken - Take a job slot for a job without blocking.  Returns
+ *    the token, or NOTOKEN if every slot is in use right now.
+ */
+int gettoken(void)
+{
+    unsigned char c;
+
+    if (js_rfd < 0)             /* no jobserver: no limit */
+	return IMPLICIT;
+    if (js_implicit) {
+	js_implicit = 0;
+	return IMPLICIT;
+    }
+    if (read(js_rfd, &c, 1) == 1)
+	return c;
+    return NOTOKEN;
+}
+
+/*
+ * waittoken - Take a job slot for a foreground job, waiting as long as
+ *    every slot is in use, with the signal mask prev.  Returns NOTOKEN
+ *    if ctrl-c came first.  Called with SIGCHLD blocked.
+ */
+int waittoken(sigset_t *prev)
+{
+    struct pollfd pfd;
+    int token;
+
+    pfd.fd = js_rfd;
+    pfd.events = POLLIN;
+    interrupted = 0;
+    while ((token = gettoken()) == NOTOKEN && !interrupted)
+	ppoll(&pfd, 1, NULL, prev);     /* a token, or a job of ours done */
+    return token;
+}
+
+/*
+ * puttoken - Give back a job slot.  Async-signal-safe; it is called
+ *    from the SIGCHLD reap path.
+ */
+void puttoken(int token)
+{
+    unsigned char c = token;
+
+    if (js_rfd < 0 || token == NOTOKEN)
+	return;
+    if (token == IMPLICIT)
+	js_implicit = 1;
+    else
+	while (write(js_wfd, &c, 1) < 0 && errno == EINTR)
+	    ;
+}
+
+/*************************************************
+ * Job event stream: one JSON object per line for
+ * each job state transition, for monitoring tools
+ *************************************************/
+
+/*
+ * openevents - Send job events to dest, a file descriptor number or a
+ *    file/FIFO name.  Writes never block: a reader that falls behind
+ *    loses events, and the next one delivered says how many.  An fd is
+ *    reopened privately, so that our own stdout (-e 1) stays blocking
+ *    and jobs do not inherit it.
+ */
+void openevents(char *dest)
+{
+    char *end;
+    int fd = strtol(dest, &end, 10);
+
+    if (*dest == '\0' || *end != '\0') {
+	fd = open(dest, O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0666);
+	if (fd < 0 && errno == ENXIO)   /* FIFO with no reader yet */
+	    fd = open(dest, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	    unix_error("event stream open error");
+    }
+    else if (fcntl(fd, F_GETFD) < 0 || (fd = openprivate(fd, O_WRONLY | O_APPEND)) < 0)
+	unix_error("event stream fd error");
+    ev_fd = fd;
+}
+
+/*
+ * jobevent - Emit event ev for job (which may be NULL) or process pid,
+ *    with an optional extra integer field key.  Async-signal-safe, so
+ *    it is also used from the signal handlers and forked children.
+ */
+void jobevent(char *ev, struct job_t *job, pid_t pid, char *key, long long val)
+{
+    char buf[256], *p = buf;
+    int olderrno = errno;
+
+    if (ev_fd < 0)
+	return;
+    p = putstr(p, "{\"ts\":");
+    p = putnum(p, nsnow());
+    p = putstr(p, ",\"ev\":\"");
+    p = putstr(p, ev);
+    p = putstr(p, "\",\"pid\":");
+    p = putnum(p, pid);
+    p = putstr(p, ",\"pgid\":");
+    p = putnum(p, pid);         /* every job leads its own group */
+    if (job != NULL) {
+	p = putstr(p, ",\"jid\":");
+	p = putnum(p, job->jid);
+    }
+    if (key != NULL) {
+	p = putstr(p, ",\"");
+	p = putstr(p, key);
+	p = putstr(p, "\":");
+	p = putnum(p, val);
+    }
+    if (ev_dropped) {
+	p = putstr(p, ",\"dropped\":");
+	p = putnum(p, ev_dropped);
+    }
+    p = putstr(p, "}\n");
+
+    /* One write of less than PIPE_BUF bytes, so lines never interleave */
+    if (write(ev_fd, buf, p - buf) == p - buf)
+	ev_dropped = 0;
+    else
+	ev_dropped++;
+    errno = olderrno;
+}
+
+/* nsnow - CLOCK_MONOTONIC time in nanoseconds */
+long long nsnow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* putstr - Async-signal-safe strcpy that returns the end of dst */
+char *putstr(char *dst, char *src)
+{
+    while (*src)
+	*dst++ = *src++;
+    return dst;
+}
+
+/* putnum - Async-signal-safe decimal formatting of n into dst */
+char *putnum(char *dst, long long n)
+{
+    char tmp[24];
+    int i = 0;
+    unsigned long long u = n < 0 ? -(unsigned long long)n : n;
+
+    if (n < 0)
+	*dst++ = '-';
+    do
+	tmp[i++] = '0' + u % 10;
+    while ((u /= 10) != 0);
+    while (i > 0)
+	*dst++ = tmp[--i];
+    return dst;
+}
+
+#ifdef TSH_TRACE
+/********************************************
+ * Hot-path tracing (compiled with TSH_TRACE)
+ ********************************************/
+
+/*
+ * tracepoint - Record a trace event.  Async-signal-safe: a handler
+ *    that interrupts us simply takes the next slot.
+ */
+void tracepoint(char *name, char ph)
+{
+    struct trace_t *t = &tracebuf[__sync_fetch_and_add(&ntrace, 1) & (TRACEBUF-1)];
+
+    t->name = name;
+    t->ph = ph;
+    t->ts = nsnow();
+}
+
+/*
+ * tracedump - Write the trace buffer to file (default tsh.<pid>.trace.json)
+ *    in Chrome trace format.  Async-signal-safe, for sigusr1_handler.
+ *    Returns -1 with errno set if the file cannot be written.
+ */
+int tracedump(char *file)
+{
+    char path[64], buf[4096], *p = buf;
+    unsigned int i, n = ntrace;
+    pid_t pid = getpid();
+    int fd;
+
+    if (file == NULL) {
+	p = putstr(path, "tsh.");
+	p = putnum(p, pid);
+	p = putstr(p, ".trace.json");
+	*p = '\0';
+	file = path;
+    }
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+	return -1;
+
+    p = putstr(buf, "{\"traceEvents\":[\n");
+    for (i = n > TRACEBUF ? n - TRACEBUF : 0; i < n; i++) {
+	struct trace_t *t = &tracebuf[i & (TRACEBUF-1)];
+
+	if (p - buf > sizeof(buf) - 256) {
+	    write(fd, buf, p - buf);
+	    p = buf;
+	}
+	p = putstr(p, "{\"name\":\"");
+	p = putstr(p, t->name);
+	p = putstr(p, "\",\"ph\":\"");
+	*p++ = t->ph;
+	p = putstr(p, t->ph == 'i' ? "\",\"s\":\"t" : "");
+	p = putstr(p, "\",\"ts\":");
+	p = putnum(p, t->ts / 1000);            /* microseconds */
+	*p++ = '.';
+	*p++ = '0' + t->ts / 100 % 10;
+	*p++ = '0' + t->ts / 10 % 10;
+	*p++ = '0' + t->ts % 10;
+	p = putstr(p, ",\"pid\":");
+	p = putnum(p, pid);
+	p = putstr(p, ",\"tid\":");
+	p = putnum(p, pid);
+	p = putstr(p, i + 1 < n ? "},\n" : "}\n");
+    }
+    p = putstr(p, "]}\n");
+    write(fd, buf, p - buf);
+    close(fd);
+    return 0;
+}
+
+/*
+ * sigusr1_handler - Dump the trace buffer on request from outside,
+ *    e.g. kill -USR1 while a foreground job is running.
+ */
+void sigusr1_handler(int sig)
+{
+    int olderrno = errno;
+
+    tracedump(NULL);
+    errno = olderrno;
+}
+#endif
+
+/*******************************************************
+ * Job timeouts: one hashed timer wheel ticked by SIGALRM
+ * (sigalrm_handler), so each tick only looks at the jobs
+ * in one slot however many timeouts are armed
+ *******************************************************/
+
+/* parsems - Parse a duration like 1.5s, 200ms, 2m or 1h into ms, -1 if bad */
+long long parsems(char *s)
+{
+    char *end;
+    double n = strtod(s, &end);
+
+    if (end == s || n < 0)
+	return -1;
+    if (strcmp(end, "ms") == 0)
+	return n;
+    if (*end == '\0' || strcmp(end, "s") == 0)
+	return n * 1000;
+    if (strcmp(end, "m") == 0)
+	return n * 60000;
+    if (strcmp(end, "h") == 0)
+	return n * 3600000;
+    return -1;
+}
+
+/*
+ * parselimits - Parse "timeout [-k <grace>] [-c <cpu>] <duration>" at
+ *    the start of argv into lim.  Returns the index of the argument
+ *    after them, or 0 after printing usage if they are malformed.
+ */
+int parselimits(char **argv, struct limit_t *lim)
+{
+    int i, ok = 1;
+
+    lim->wall = lim->cpu = 0;
+    lim->grace = DEFGRACE;
+    for (i = 1; ok && argv[i] != NULL && argv[i][0] == '-' && argv[i+1] != NULL; i += 2) {
+	if (strcmp(argv[i], "-k") == 0)
+	    ok = (lim->grace = parsems(argv[i+1])) >= 0;
+	else if (strcmp(argv[i], "-c") == 0)
+	    ok = (lim->cpu = parsems(argv[i+1])) >= 0;
+	else
+	    ok = 0;
+    }
+    if (!ok || argv[i] == NULL || (lim->wall = parsems(argv[i])) < 0) {
+	printf("timeout: usage: timeout [-k <grace>] [-c <cpu>] <duration> <job> ...\n");
+	printf("                timeout [-k <grace>] [-c <cpu>] <duration> -- <command>\n");
+	return 0;
+    }
+    return i + 1;
+}
+
+/*
+ * cmdlimits - If argv is "timeout ... -- <command>", strip it down to
+ *    command in place and return 1 with its limits in lim.  Returns 0
+ *    (no limits) for any other command line and -1 if it is malformed
+ *    or command is a builtin, which runs in tsh and cannot be limited.
+ */
+int cmdlimits(char **argv, struct limit_t *lim)
+{
+    int i, j;
+
+    lim->wall = lim->cpu = 0;
+    if (strcmp(argv[0], "timeout") != 0)
+	return 0;
+    for (i = 1; argv[i] != NULL && strcmp(argv[i], "--") != 0; i++)
+	;
+    if (argv[i] == NULL)
+	return 0;               /* timeout <job> ...: do_timeout's */
+    if ((j = parselimits(argv, lim)) == 0)
+	return -1;
+    if (j != i || argv[i+1] == NULL) {
+	printf("timeout: usage: timeout [-k <grace>] [-c <cpu>] <duration> -- <command>\n");
+	return -1;
+    }
+    for (j = 0; (argv[j] = argv[i+1+j]) != NULL; j++)
+	;
+    for (j = 0; argv[j] != NULL && assignment(argv[j]); j++)
+	;
+    if (argv[j] == NULL || isbuiltin(argv[j])) {
+	printf("timeout: %s: cannot limit a builtin\n", argv[j] != NULL ? argv[j] : argv[0]);
+	return -1;
+    }
+    return 1;
+}
+
+/* isbuiltin - Is name a command that builtin_cmd runs itself? */
+int isbuiltin(char *name)
+{
+    static char *names[] = {
+	"quit", "jobs", "bg", "fg", "after", "wait", "timeout", "kill",
+	"history", "export", "unset", "apply",
+#ifdef TSH_TRACE
+	"tracedump",
+#endif
+	NULL
+    };
+    int i;
+
+    for (i = 0; names[i] != NULL; i++)
+	if (strcmp(name, names[i]) == 0)
+	    return 1;
+    return 0;
+}
+
+/*
+ * cpurlimit - Fill in rl with the RLIMIT_CPU for lim's -c.  Returns 1,
+ *    or 0 if lim has no CPU limit.  Async-signal-safe.
+ */
+int cpurlimit(struct limit_t *lim, struct rlimit *rl)
+{
+    if (lim->cpu <= 0)
+	return 0;
+    rl->rlim_cur = (lim->cpu + 999) / 1000;     /* RLIMIT_CPU is in s */
+    rl->rlim_max = rl->rlim_cur + (lim->grace + 999) / 1000;
+    if (rl->rlim_max == rl->rlim_cur)
+	rl->rlim_max++;         /* SIGXCPU first, then SIGKILL */
+    return 1;
+}
+
+/*
+ * setlimits - Start job's wall-clock timeout now that it is running
+ *    (spawn has already set its CPU limit).  Called with SIGCHLD and
+ *    SIGALRM blocked, or from the SIGCHLD handler.
+ */
+void setlimits(struct job_t *job)
+{
+    disarmtimer(job);
+    if (job->lim.wall > 0)
+	armtimer(job, job->lim.wall, 1);
+}
+
+/*
+ * armtimer - Make job's timer fire stage in ms (rounded up to a tick).
+ *    The tick only runs while some timer is armed.
+ */
+void armtimer(struct job_t *job, long long ms, int stage)
+{
+    long long ticks = (ms + TICK_MS - 1) / TICK_MS;
+    struct itimerval it;
+
+    if (ticks < 1)
+	ticks = 1;
+    job->tstage = stage;
+    job->tslot = (wheelpos + ticks) & (WHEELSIZE-1);
+    job->trounds = (ticks - 1) / WHEELSIZE;
+    job->tprev = NULL;
+    if ((job->tnext = wheel[job->tslot]) != NULL)
+	job->tnext->tprev = job;
+    wheel[job->tslot] = job;
+
+    if (ntimers++ == 0) {
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = TICK_MS * 1000;
+	it.it_value = it.it_interval;
+	setitimer(ITIMER_REAL, &it, NULL);
+    }
+}
+
+/* disarmtimer - Cancel job's timer, if any */
+void disarmtimer(struct job_t *job)
+{
+    struct itimerval it;
+
+    if (job->tstage == 0)
+	return;
+    if (job->tprev != NULL)
+	job->tprev->tnext = job->tnext;
+    else
+	wheel[job->tslot] = job->tnext;
+    if (job->tnext != NULL)
+	job->tnext->tprev = job->tprev;
+    job->tstage = 0;
+
+    if (--ntimers == 0) {
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_REAL, &it, NULL);
+    }
+}
+
+/*****************************************************
+ * Terminal job control: when stdin is our terminal the
+ * FG job owns it, so the kernel signals the job itself
+ *****************************************************/
+
+/*
+ * initterminal - Enable job control if stdin is a terminal and we are
+ *    its foreground process group.  Otherwise (e.g. driven through a
+ *    pipe by sdriver.pl) ctrl-c and ctrl-z keep reaching the shell,
+ *    whose handlers forward them to the FG job.
+ */
+void initterminal(void)
+{
+    if (!isatty(STDIN_FILENO))
+	return;
+    shell_pgid = getpgrp();
+    if (tcgetpgrp(STDIN_FILENO) != shell_pgid)
+	return;                 /* started in the background */
+    if (tcgetattr(STDIN_FILENO, &shell_tmodes) < 0)
+	return;
+
+    /* We call tcsetpgrp/tcsetattr while not owning the terminal */
+    Signal(SIGTTOU, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
+    jobcontrol = 1;
+}
+
+/*
+ * giveterminal - Make job the terminal's foreground process group,
+ *    restoring the terminal modes it had when it was stopped
+ */
+void giveterminal(struct job_t *job)
+{
+    if (!jobcontrol)
+	return;
+    if (job->hastmodes)
+	tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+    tcsetpgrp(STDIN_FILENO, job->pid);
+}
+
+/*
+ * taketerminal - The FG job pid has stopped or exited: take the
+ *    terminal back, saving its modes if it is only stopped, and
+ *    restore our own modes
+ */
+void taketerminal(pid_t pid)
+{
+    struct job_t *job;
+
+    if (!jobcontrol)
+	return;
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    if ((job = getjobpid(jobs, pid)) != NULL)
+	job->hastmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+}
+
+/*****************************************************
+ * cgroup freezer (-c): each job gets a cgroup, so stop
+ * and continue reach its whole process tree at once.
+ * A ctrl-z typed while a job owns the terminal goes to
+ * the job, not to us: it is frozen once its leader
+ * stops, but a leader that catches SIGTSTP is not.
+ *****************************************************/
+
+/*
+ * initcgroups - Make a cgroup under our own (cgroup v2) to hold the
+ *    job cgroups.  If there is no cgroup v2 or we may not write to it,
+ *    stay without one: jobs are then stopped with signals as usual.
+ */
+void initcgroups(void)
+{
+    char line[MAXLINE], mnt[MAXLINE], *p;
+    FILE *fp;
+    int n;
+
+    mnt[0] = '\0';
+    if ((fp = fopen("/proc/self/mountinfo", "r")) == NULL)
+	return;
+    while (fgets(line, MAXLINE, fp) != NULL)
+	if (strstr(line, " - cgroup2 ") != NULL &&
+	    sscanf(line, "%*s %*s %*s %*s %1023s", mnt) == 1)
+	    break;
+    fclose(fp);
+    if (mnt[0] == '\0' || (fp = fopen("/proc/self/cgroup", "r")) == NULL)
+	return;
+    while ((p = fgets(line, MAXLINE, fp)) != NULL && strncmp(line, "0::", 3) != 0)
+	;
+    fclose(fp);
+    if (p == NULL)
+	return;
+    line[strcspn(line, "\n")] = '\0';
+
+    n = snprintf(cg_path, MAXLINE, "%s%s", mnt, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+    if (n + 16 >= MAXLINE)
+	return;
+    sweepcgroups(cg_path);
+    sprintf(cg_path + n, "/tsh.%d", (int)getpid());
+    if (mkdir(cg_path, 0755) < 0 && errno != EEXIST)
+	goto fail;
+    if ((cg_dir = open(cg_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+	rmdir(cg_path);
+	goto fail;
+    }
+    atexit(endcgroups);
     return;
+
+fail:
+    if (verbose)
+	printf("initcgroups: %s: %s, using signals\n", cg_path, strerror(errno));
+}
+
+/*
+ * sweepcgroups - Remove the empty job cgroups, and then the cgroup
+ *    holding them, that shells which are gone left behind in dir
+ */
+void sweepcgroups(char *dir)
+{
+    char path[MAXLINE];
+    struct dirent *de;
+    DIR *dp, *jp;
+    int pid;
+
+    if ((dp = opendir(dir)) == NULL)
+	return;
+    while ((de = readdir(dp)) != NULL) {
+	if (sscanf(de->d_name, "tsh.%d", &pid) != 1 || kill(pid, 0) == 0 || errno != ESRCH)
+	    continue;
+	if (snprintf(path, MAXLINE, "%s/%s", dir, de->d_name) >= MAXLINE)
+	    continue;
+	if ((jp = opendir(path)) != NULL) {
+	    while ((de = readdir(jp)) != NULL)
+		if (isdigit(de->d_name[0]))
+		    unlinkat(dirfd(jp), de->d_name, AT_REMOVEDIR);
+	    closedir(jp);
+	}
+	rmdir(path);
+    }
+    closedir(dp);
+}
+
+/*
+ * endcgroups - On exit, treat our frozen jobs the way the kernel treats
+ *    a stopped process group that its shell orphans: SIGHUP, then thaw
+ *    and SIGCONT.  Then remove our cgroup, if no job outlives us in it.
+ */
+void endcgroups(void)
+{
+    sigset_t mask;
+    int i;
+
+    sigfillset(&mask);          /* we are leaving: reap nothing more */
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].state == ST && jobs[i].cgfreeze >= 0) {
+	    kill(-(jobs[i].pid), SIGHUP);
+	    signaljob(&jobs[i], SIGCONT);
+	}
+    for (i = 0; i < ncg_busy; i++)
+	cgrmdir(cg_busy[i]);
+    rmdir(cg_path);
+}
+
+/*
+ * cgenter - In a newly forked child: create the job's cgroup, named
+ *    after its process group, and move into it before execve, so that
+ *    everything the job forks is inside from the start.  The parent
+ *    creates it too (cgopen); whichever runs first does the mkdir.
+ */
+void cgenter(void)
+{
+    char name[32];
+    int fd;
+
+    if (cg_dir < 0)
+	return;
+    sprintf(name, "%d", (int)getpid());
+    mkdirat(cg_dir, name, 0755);
+    strcat(name, "/cgroup.procs");
+    if ((fd = openat(cg_dir, name, O_WRONLY)) >= 0) {
+	write(fd, "0", 1);      /* 0 is the writer itself */
+	close(fd);
+    }
+}
+
+/* cgopen - Create job's cgroup if needed and keep its control files open */
+void cgopen(struct job_t *job)
+{
+    char name[48];
+    int n;
+
+    if (cg_dir < 0)
+	return;
+    n = sprintf(name, "%d", (int)job->pid);
+    mkdirat(cg_dir, name, 0755);
+    strcpy(name + n, "/cgroup.freeze");
+    job->cgfreeze = openat(cg_dir, name, O_WRONLY | O_CLOEXEC);
+    strcpy(name + n, "/cgroup.events");
+    job->cgevents = openat(cg_dir, name, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * cgfreeze - Freeze (or thaw) job's whole cgroup with a single write.
+ *    Returns 0, or -1 if the job has no cgroup.  Async-signal-safe.
+ */
+int cgfreeze(struct job_t *job, int frozen)
+{
+    if (job->cgfreeze < 0)
+	return -1;
+    return pwrite(job->cgfreeze, frozen ? "1" : "0", 1, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * cgfrozen - Returns 1 if job's cgroup has finished freezing, 0 if
+ *    not, -1 if the job has no cgroup
+ */
+int cgfrozen(struct job_t *job)
+{
+    char buf[128], *p;
+    ssize_t n;
+
+    if (job->cgevents < 0 || (n = pread(job->cgevents, buf, sizeof(buf) - 1, 0)) < 0)
+	return -1;
+    buf[n] = '\0';
+    if ((p = strstr(buf, "frozen ")) == NULL)
+	return -1;
+    return p[7] == '1';
+}
+
+/*
+ * cgremove - Job is done: thaw whatever it left behind in its cgroup,
+ *    so that nothing stays frozen for good, and remove the cgroup.  If
+ *    processes that left the job's group still hold it, it is retried
+ *    whenever another job is done, and at exit.  Async-signal-safe.
+ */
+void cgremove(struct job_t *job)
+{
+    int i;
+
+    if (job->cgfreeze < 0)
+	return;
+    cgfreeze(job, 0);
+    close(job->cgfreeze);
+    close(job->cgevents);
+    job->cgfreeze = job->cgevents = -1;
+
+    for (i = 0; i < ncg_busy; i++)
+	if (cgrmdir(cg_busy[i]) == 0)
+	    cg_busy[i--] = cg_busy[--ncg_busy];
+    if (cgrmdir(job->pid) < 0 && errno == EBUSY && ncg_busy < MAXJOBS)
+	cg_busy[ncg_busy++] = job->pid;
+}
+
+/* cgrmdir - Remove the cgroup of the job led by pid.  Async-signal-safe. */
+int cgrmdir(pid_t pid)
+{
+    char name[32], *p = name + sizeof(name);
+
+    *--p = '\0';               /* no sprintf in a signal handler */
+    do {
+	*--p = '0' + pid % 10;
+    } while ((pid /= 10) > 0);
+    return unlinkat(cg_dir, p, AT_REMOVEDIR);
+}
+
+/*
+ * markfrozen - signaljob froze job rather than stopping it.  No SIGCHLD
+ *    will report that, so do what the reap path does for a stop.
+ */
+void markfrozen(struct job_t *job)
+{
+    job->state = ST;
+    jobevent("freeze", job, job->pid, NULL, 0);
+    printf("Job [%d] (%d) frozen\n", job->jid, job->pid);
+}
+
+/*****************************************************
+ * Shell variables: VAR=val, export and unset, $VAR in
+ * parseline, and the cached environment of our children
+ *****************************************************/
+
+/* initvars - Import the environment we were started with, all exported */
+void initvars(void)
+{
+    char **ep;
+    int i;
+
+    for (ep = environ; *ep != NULL; ep++)
+	if (assignment(*ep))
+	    setvar(*ep, 0);
+    for (i = 0; i < nvars; i++)
+	vars[i].exported = 1;
+    buildenv();                 /* once, not per variable */
+}
+
+/*
+ * assignment - If word is NAME=value with a valid name, return the
+ *    length of NAME, else 0.  Async-signal-safe.
+ */
+int assignment(char *word)
+{
+    int i;
+
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+	return 0;
+    for (i = 1; isalnum((unsigned char)word[i]) || word[i] == '_'; i++)
+	;
+    return word[i] == '=' ? i : 0;
+}
+
+/*
+ * findvar - Binary search vars for the len-char name.  Returns 1 and
+ *    its index in *pos if it is set, or 0 and where it would go.
+ */
+int findvar(char *name, int len, int *pos)
+{
+    int lo = 0, hi = nvars, mid, c;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	c = strncmp(vars[mid].str, name, len);
+	if (c == 0)
+	    c = vars[mid].namelen - len;
+	if (c == 0) {
+	    *pos = mid;
+	    return 1;
+	}
+	if (c < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    *pos = lo;
+    return 0;
+}
+
+/* getvar - Value of the len-char name, or NULL if it is not set */
+char *getvar(char *name, int len)
+{
+    int pos;
+
+    if (!findvar(name, len, &pos))
+	return NULL;
+    return vars[pos].str + len + 1;
 }
 
 /*
-trace11.txt – 将 SIGINT 信号发送给前台进程集里的每个进程
-trace12.txt – 将 SIGTSTP 信号发送给前台进程集里的每个进程
-trace13.txt – 将进程集里的每个停止的进程重启
-trace14.txt – 简单的错误处理
-trace15.txt – 全都混到一起
-trace16.txt – 测试 shell 是否能够处理来自其他进程（而不是终端）的 SIGTSTP 和 SIGINT 信号
-*/
+ * setvar - Set a variable from str, NAME=value.  It is exported if it
+ *    already was or exported is true.  Returns 0, or -1 if out of memory.
+ */
+int setvar(char *str, int exported)
+{
+    int len = assignment(str), pos;
+    struct var_t *v;
+    char *copy, *old = NULL;
+
+    if ((copy = strdup(str)) == NULL)
+	return -1;
+    if (findvar(str, len, &pos)) {
+	v = &vars[pos];
+	exported |= v->exported;
+	if (exported && !v->exported)
+	    v->exported = 1;
+	else if (strcmp(v->str, copy) == 0) {
+	    free(copy);         /* same value: the environment stays as is */
+	    return 0;
+	}
+	old = v->str;           /* childenv may point at it until rebuilt */
+	v->str = copy;
+    }
+    else {
+	if (nvars == varcap) {
+	    varcap = varcap ? 2 * varcap : 64;
+	    if ((v = realloc(vars, varcap * sizeof(struct var_t))) == NULL) {
+		free(copy);
+		return -1;
+	    }
+	    vars = v;
+	}
+	memmove(&vars[pos+1], &vars[pos], (nvars - pos) * sizeof(struct var_t));
+	nvars++;
+	vars[pos].str = copy;
+	vars[pos].namelen = len;
+	vars[pos].exported = exported;
+    }
+    if (exported)
+	buildenv();
+    free(old);
+    return 0;
+}
 
-/*********************
- * End signal handlers
- *********************/
+/* unsetvar - Remove the variable name, if set */
+void unsetvar(char *name)
+{
+    int pos, exported;
+    char *old;
+
+    if (!findvar(name, strlen(name), &pos))
+	return;
+    exported = vars[pos].exported;
+    old = vars[pos].str;
+    memmove(&vars[pos], &vars[pos+1], (nvars - pos - 1) * sizeof(struct var_t));
+    nvars--;
+    if (exported)
+	buildenv();
+    free(old);
+}
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/*
+ * buildenv - Rebuild childenv, the envp that spawn passes to execve,
+ *    after an exported variable has changed.  It points at the
+ *    variables' own strings, so this copies pointers, not text, and
+ *    launching a command costs no allocation or copying at all.
+ *    Called with SIGCHLD unblocked only from builtins, never from the
+ *    reap path, so spawn always sees a complete array.
+ */
+void buildenv(void)
+{
+    sigset_t mask, prev;
+    char **env;
+    int i, n = 0;
+
+    for (i = 0; i < nvars; i++)
+	n += vars[i].exported;
+    if ((env = malloc((n + 1) * sizeof(char *))) == NULL)
+	return;
+    for (i = 0, n = 0; i < nvars; i++)
+	if (vars[i].exported)
+	    env[n++] = vars[i].str;
+    env[n] = NULL;
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);  /* launchready may spawn from the handler */
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    free(childenv);
+    childenv = env;
+    nchildenv = n;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
+/*
+ * execwith - In a newly forked child: execve argv past its n VAR=val
+ *    prefixes, with the environment cached in childenv plus those (the
+ *    last of each name wins).  The merged envp lives on the stack, as
+ *    the child may have been forked from a signal handler.  Returns
+ *    only if execve fails.
+ */
+void execwith(char **argv, int n)
+{
+    char *envp[nchildenv + n + 1];
+    int i, j, nenv = 0;
+
+    for (i = 0; i < nchildenv; i++) {           /* drop what they override */
+	for (j = 0; j < n && strncmp(childenv[i], argv[j], assignment(argv[j]) + 1) != 0; j++)
+	    ;
+	if (j == n)
+	    envp[nenv++] = childenv[i];
+    }
+    for (i = 0; i < n; i++) {
+	for (j = i + 1; j < n && strncmp(argv[i], argv[j], assignment(argv[j]) + 1) != 0; j++)
+	    ;
+	if (j == n)
+	    envp[nenv++] = argv[i];
+    }
+    envp[nenv] = NULL;
+    execve(argv[n], argv + n, envp);
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+/*
+ * expandvar - *src points at a '$' in an unquoted word.  Copy the
+ *    value of $NAME or ${NAME}, or our PID for $$, to *dst (at most up
+ *    to end) and move both past it.  Returns 1, or 0 if the '$' starts
+ *    no expansion and was copied as it is.
+ */
+int expandvar(const char **src, char **dst, char *end)
+{
+    const char *name = *src + 1, *val;
+    char pid[16];
+    int len, braced = (*name == '{');
+
+    if (*name == '$') {
+	sprintf(pid, "%d", (int)getpid());
+	val = pid;
+	*src += 2;
+    }
+    else {
+	name += braced;
+	for (len = 0; isalnum((unsigned char)name[len]) || name[len] == '_'; len++)
+	    ;
+	if (len == 0 || isdigit((unsigned char)name[0]) || (braced && name[len] != '}')) {
+	    if (*dst < end)
+		*(*dst)++ = '$';
+	    (*src)++;
+	    return 0;
+	}
+	val = getvar((char *)name, len);
+	*src = name + len + braced;
+    }
+    while (val != NULL && *val != '\0' && *dst < end)
+	*(*dst)++ = *val++;
+    return 1;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs)
+/*****************************************************
+ * Glob expansion: each pattern component is compiled
+ * once, and directories are read in large getdents64
+ * batches, with no stat unless a type really matters
+ *****************************************************/
+
+/*
+ * globcompile - Split pattern at '/' and compile its components into
+ *    globpat.  Returns -1 if it is too complex, 0 otherwise.
+ */
+int globcompile(char *pattern)
 {
-    int i, max=0;
+    static char src[MAXLINE];
+    char *s, *slash;
+
+    if (strlen(pattern) >= MAXLINE)
+	return -1;
+    strcpy(src, pattern);
+    nglobpat = 0;
+    globdirs = 0;
+    for (s = src; *s != '\0'; s = slash + 1) {
+	if ((slash = strchr(s, '/')) != NULL)
+	    *slash = '\0';
+	if (*s != '\0') {       /* a//b is a/b */
+	    if (nglobpat == MAXCOMP || patcompile(&globpat[nglobpat++], s) < 0)
+		return -1;
+	}
+	if (slash == NULL)
+	    break;
+	globdirs = slash[1] == '\0';
+    }
+    return 0;
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+/*
+ * patcompile - Compile the path component s into ops: bytes, ?, * and
+ *    [...] classes (with ranges, and ! or ^ to negate) as 256-bit
+ *    bitmaps, so matching a class is a single bit test.  A backslash
+ *    makes the next character literal.  Returns -1 if it is too long.
+ */
+int patcompile(struct pat_t *p, char *s)
+{
+    unsigned char *cls;
+    int i, neg, lo, hi, star = -1;
+    char *end;
+
+    p->lit = s;
+    p->meta = p->n = p->nclass = p->minlen = 0;
+    while (*s != '\0') {
+	if (p->n == MAXPAT)
+	    return -1;
+	if (*s == '*') {
+	    if (p->n == 0 || p->op[p->n-1] != GLOB_STAR)    /* ** is * */
+		p->op[p->n++] = GLOB_STAR;
+	    star = p->n;
+	    p->meta = 1;
+	    s++;
+	    continue;
+	}
+	p->minlen++;
+	if (*s == '?') {
+	    p->op[p->n++] = GLOB_ANY;
+	    p->meta = 1;
+	    s++;
+	    continue;
+	}
+	if (*s == '[' && p->nclass < MAXCLASS) {
+	    end = s + 1 + (s[1] == '!' || s[1] == '^');
+	    end += *end == ']';                 /* []...] has a ] in it */
+	    if ((end = strchr(end, ']')) != NULL) {
+		cls = p->cls[p->nclass];
+		memset(cls, 0, 32);
+		s++;
+		if ((neg = (*s == '!' || *s == '^')))
+		    s++;
+		do {
+		    lo = hi = (unsigned char)*s++;
+		    if (*s == '-' && s + 1 < end) {
+			hi = (unsigned char)s[1];
+			s += 2;
+		    }
+		    for (i = lo; i <= hi; i++)
+			cls[i >> 3] |= 1 << (i & 7);
+		} while (s < end);
+		if (neg)
+		    for (i = 0; i < 32; i++)
+			cls[i] = ~cls[i];
+		p->op[p->n++] = GLOB_CLASS + p->nclass++;
+		p->meta = 1;
+		s = end + 1;
+		continue;
+	    }
+	}
+	if (*s == '\\' && s[1] != '\0')
+	    s++;
+	p->op[p->n++] = (unsigned char)*s++;
+    }
+
+    p->ntail = 0;               /* literal bytes after the last * */
+    if (star >= 0)
+	for (i = p->n - 1; i >= star && p->op[i] < GLOB_ANY; i--)
+	    p->ntail++;
+    if (!p->meta) {             /* taken as it is: drop the backslashes */
+	for (i = 0; i < p->n; i++)
+	    p->lit[i] = p->op[i];
+	p->lit[p->n] = '\0';
+    }
+    return 0;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
+/*
+ * globmatch - Does name (len bytes) match component p?  Runs the ops
+ *    left to right, going back only to the last * on a mismatch, so
+ *    it never takes more than len * ops steps.
+ */
+int globmatch(struct pat_t *p, const char *name, int len)
 {
-    int i;
+    int pi = 0, ni = 0, star = -1, mark = 0, op, i;
+    unsigned char c;
 
-    if (pid < 1)
+    if (len < p->minlen)
 	return 0;
+    for (i = 1; i <= p->ntail; i++)     /* *.log: check the end first */
+	if ((unsigned char)name[len-i] != p->op[p->n-i])
+	    return 0;
+
+    while (ni < len) {
+	if (pi < p->n && p->op[pi] == GLOB_STAR) {
+	    star = ++pi;
+	    mark = ni;
+	    continue;
+	}
+	if (pi < p->n) {
+	    op = p->op[pi];
+	    c = name[ni];
+	    if (op == c || op == GLOB_ANY ||
+		(op >= GLOB_CLASS && (p->cls[op - GLOB_CLASS][c >> 3] & (1 << (c & 7))))) {
+		pi++;
+		ni++;
+		continue;
+	    }
+	}
+	if (star < 0)
+	    return 0;
+	pi = star;              /* let the last * take one more byte */
+	ni = ++mark;
+    }
+    while (pi < p->n && p->op[pi] == GLOB_STAR)
+	pi++;
+    return pi == p->n;
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+/*
+ * globwalk - globpath holds plen bytes matching the first c components:
+ *    match the rest, calling found(path, arg) on each complete match.
+ *    Names starting with '.' match only a component that does too, and
+ *    "." and ".." never match.  The d_type getdents64 returns tells
+ *    directories apart; stat is needed only where a directory is
+ *    required and the file system (or a symlink) leaves it open.
+ *    Returns -1 as soon as found does, 0 otherwise.
+ */
+int globwalk(int c, int plen, int (*found)(char *path, void *arg), void *arg)
+{
+    struct pat_t *p = &globpat[c];
+    struct dirent64 *de;
+    struct stat st;
+    char *buf, *name;
+    long n, off;
+    int fd, len, isdir, last = (c == nglobpat - 1), rc = 0;
+
+    if (c == nglobpat) {
+	if (globdirs && plen + 1 < PATH_MAX)
+	    strcpy(globpath + plen, "/");
+	return found(globpath, arg);
+    }
+    if (plen > 0 && globpath[plen-1] != '/')
+	globpath[plen++] = '/';
+    globpath[plen] = '\0';
+
+    if (!p->meta) {             /* no need to read the directory */
+	if (plen + (len = strlen(p->lit)) >= PATH_MAX)
+	    return 0;
+	strcpy(globpath + plen, p->lit);
+	if (last && (fstatat(AT_FDCWD, globpath, &st, globdirs ? 0 : AT_SYMLINK_NOFOLLOW) < 0 ||
+		     (globdirs && !S_ISDIR(st.st_mode))))
+	    return 0;
+	return globwalk(c + 1, plen + len, found, arg);
+    }
+
+    if ((fd = open(plen > 0 ? globpath : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	return 0;
+    if ((buf = malloc(DIRBUF)) == NULL) {
+	close(fd);
+	return 0;
+    }
+    while (rc == 0 && (n = getdents64(fd, buf, DIRBUF)) > 0) {
+	for (off = 0; rc == 0 && off < n; off += de->d_reclen) {
+	    de = (struct dirent64 *)(buf + off);
+	    name = de->d_name;
+	    if (name[0] == '.' &&
+		(p->op[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+		continue;
+	    len = strlen(name);
+	    if (!globmatch(p, name, len) || plen + len >= PATH_MAX)
+		continue;
+	    if (!last || globdirs) {
+		isdir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+		    isdir = fstatat(fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		if (!isdir)
+		    continue;
+	    }
+	    memcpy(globpath + plen, name, len + 1);
+	    rc = globwalk(c + 1, plen + len, found, arg);
 	}
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    free(buf);
+    close(fd);
+    return rc;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid)
+/*
+ * globrun - Call found(path, arg) on every path matching pattern, in
+ *    directory order.  Returns -1 if found stopped it, 0 otherwise.
+ */
+int globrun(char *pattern, int (*found)(char *path, void *arg), void *arg)
 {
-    int i;
+    int plen = 0;
 
-    if (pid < 1)
+    if (globcompile(pattern) < 0)
 	return 0;
+    if (pattern[0] == '/')
+	globpath[plen++] = '/';
+    globpath[plen] = '\0';
+    if (nglobpat == 0)          /* just "/" */
+	return globdirs ? found(globpath, arg) : 0;
+    return globwalk(0, plen, found, arg);
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
+/* globcmp - qsort comparison of two paths */
+int globcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* globcollect - globrun callback of expandargv: add path to its argv */
+int globcollect(char *path, void *arg)
+{
+    struct globout_t *out = arg;
+    int len = strlen(path) + 1;
+
+    if (out->argc == MAXARGS - 1 || out->next + len > out->end)
+	return -1;
+    out->argv[out->argc++] = memcpy(out->next, path, len);
+    out->next += len;
+    return 0;
+}
+
+/*
+ * expandargv - Replace each word of argv that parseline flagged as a
+ *    pattern by the paths it matches, sorted, or leave it as it is if
+ *    nothing matches.  Assignments are not expanded.  Returns -1 if
+ *    the paths do not fit in argv, after saying so.
+ */
+int expandargv(char **argv)
+{
+    static char buf[MAXARGBUF];
+    char *words[MAXARGS];
+    struct globout_t out;
+    int i, first;
+
+    for (i = 0; argv[i] != NULL && !globarg[i]; i++)
+	;
+    if (argv[i] == NULL)        /* the usual case: nothing to do */
+	return 0;
+
+    for (i = 0; argv[i] != NULL; i++)
+	words[i] = argv[i];
+    words[i] = NULL;
+    out.argv = argv;
+    out.argc = 0;
+    out.next = buf;
+    out.end = buf + MAXARGBUF;
+    for (i = 0; words[i] != NULL; i++) {
+	first = out.argc;
+	if (globarg[i] && !assignment(words[i])) {
+	    if (globrun(words[i], globcollect, &out) < 0) {
+		printf("%s: Argument list too long\n", words[i]);
+		argv[0] = NULL;
+		return -1;
+	    }
+	    if (out.argc > first) {
+		qsort(argv + first, out.argc - first, sizeof(char *), globcmp);
+		continue;
+	    }
+	}
+	if (out.argc == MAXARGS - 1) {
+	    printf("%s: Argument list too long\n", words[i]);
+	    argv[0] = NULL;
+	    return -1;
 	}
+	argv[out.argc++] = words[i];
     }
+    argv[out.argc] = NULL;
     return 0;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/* applyfound - globrun callback of apply: add path to the batch */
+int applyfound(char *path, void *arg)
+{
+    struct apply_t *ap = arg;
+    int len = strlen(path) + 1;
+
+    if (ap->argc - ap->ncmd == ap->max || ap->next + len > ap->buf + MAXARGBUF)
+	if (applylaunch(ap) < 0)
+	    return -1;
+    ap->argv[ap->argc++] = memcpy(ap->next, path, len);
+    ap->next += len;
+    ap->files++;
+    return 0;
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
+/*
+ * applylaunch - Start apply's batch as a background job once a job
+ *    slot and a jobserver token are free, and begin a new batch.
+ *    Returns -1 if ctrl-c came first, or if every slot is taken by a
+ *    stopped or waiting job, so that no slot would ever free up.
+ */
+int applylaunch(struct apply_t *ap)
+{
+    char cmdline[MAXLINE], *dst = cmdline;
+    struct job_t *job;
+    sigset_t mask, prev;
+    int i, jid, running, token = NOTOKEN;
+    pid_t pid;
+
+    if (ap->argc == ap->ncmd)
+	return 0;
+    ap->argv[ap->argc] = NULL;
+    for (i = 0; i < ap->argc; i++) {    /* for jobs: as much as fits */
+	if (dst + strlen(ap->argv[i]) + 8 > cmdline + MAXLINE) {
+	    dst = putstr(dst, "...");
+	    break;
+	}
+	dst = putstr(putstr(dst, ap->argv[i]), i == ap->argc - 1 ? "" : " ");
+    }
+    strcpy(dst, " &\n");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    while (!interrupted) {      /* the reap path frees slots and tokens */
+	for (i = 0, running = 0; i < MAXJOBS && jobs[i].jid != 0; i++)
+	    running |= jobs[i].state == BG;
+	if (i < MAXJOBS && (token = gettoken()) != NOTOKEN)
+	    break;
+	if (i == MAXJOBS && !running) {
+	    printf("apply: no job slot left: every job is stopped or waiting\n");
+	    break;
+	}
+	sigsuspend(&prev);
+    }
+    if (token == NOTOKEN) {
+	sigprocmask(SIG_SETMASK, &prev, NULL);
+	return -1;
+    }
+
+    if ((pid = spawn(ap->argv, 0, NULL)) < 0)
+	unix_error("fork error");
+    if ((jid = addjob(jobs, pid, BG, cmdline)) != 0) {
+	job = getjobjid(jobs, jid);
+	job->token = token;
+	cgopen(job);
+	printf("[%d] (%d) %s", jid, pid, cmdline);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    ap->jobs++;
+    ap->argc = ap->ncmd;
+    ap->next = ap->buf;
     return 0;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/*****************************************************
+ * Command history: an append-only file of one command
+ * per line, mapped rather than read, indexed on demand
+ *****************************************************/
 
-    if (pid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+/*
+ * openhistory - Open (or create) the history file.  It is only mapped
+ *    here, not read, so startup takes the same time however long the
+ *    history is; histsync indexes it when it is first searched.  A
+ *    record torn by a crash is ended with a newline first, so that the
+ *    next record appended is not glued onto it.
+ */
+void openhistory(char *file)
+{
+    struct stat st;
+    char last;
+
+    if ((hist_fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+	printf("%s: %s\n", file, strerror(errno));
+	return;
+    }
+    if (fstat(hist_fd, &st) < 0)
+	return;                 /* histsync maps it later */
+    if (st.st_size > 0 &&
+	pread(hist_fd, &last, 1, st.st_size - 1) == 1 && last != '\n' &&
+	write(hist_fd, "\n", 1) == 1)
+	st.st_size++;
+    if (st.st_size > 0) {
+	hist_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hist_fd, 0);
+	if (hist_map == MAP_FAILED)
+	    hist_map = NULL;
+	else
+	    hist_maplen = st.st_size;
+    }
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid)
+/*
+ * histadd - Append cmdline to the history file in a single O_APPEND
+ *    write, so that records from concurrent shells never interleave.
+ */
+void histadd(char *cmdline)
 {
-    int i;
+    char buf[MAXLINE + 1];
+    size_t len = strcspn(cmdline, "\n");
+
+    if (hist_fd < 0 || cmdline[strspn(cmdline, " \t\n")] == '\0')
+	return;
+    memcpy(buf, cmdline, len);
+    buf[len++] = '\n';
+    while (write(hist_fd, buf, len) < 0 && errno == EINTR)
+	;
+}
 
-    if (jid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+/*
+ * histsync - Map whatever has been appended to the history file since
+ *    the last call, by us or other shells, and index its complete
+ *    records.  Returns the number of records.
+ */
+int histsync(void)
+{
+    struct stat st;
+    char *map, *p, *end;
+    long *off;
+
+    if (fstat(hist_fd, &st) < 0)
+	return hist_n;
+    if ((size_t)st.st_size > hist_maplen) {
+	map = hist_map == NULL
+	    ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hist_fd, 0)
+	    : mremap(hist_map, hist_maplen, st.st_size, MREMAP_MAYMOVE);
+	if (map != MAP_FAILED) {
+	    hist_map = map;
+	    hist_maplen = st.st_size;
+	}
+    }
+
+    p = hist_map + hist_indexed;
+    end = hist_map + hist_maplen;
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+	if (hist_n + 2 > hist_cap) {
+	    hist_cap = hist_cap ? 2 * hist_cap : 1024;
+	    if ((off = realloc(hist_off, hist_cap * sizeof(long))) == NULL)
+		break;
+	    hist_off = off;
+	}
+	hist_off[hist_n++] = hist_indexed;
+	hist_indexed = ++p - hist_map;
+	hist_off[hist_n] = hist_indexed;    /* where the next one starts */
+    }
+    return hist_n;
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid)
+/* histlen - Length of record i, without its newline */
+int histlen(int i)
 {
-    int i;
+    return hist_off[i+1] - hist_off[i] - 1;
+}
 
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+/* histcmp - qsort comparison of two records by their text */
+int histcmp(const void *a, const void *b)
+{
+    int i = *(const int *)a, j = *(const int *)b;
+    int li = histlen(i), lj = histlen(j);
+    int c = memcmp(hist_map + hist_off[i], hist_map + hist_off[j], li < lj ? li : lj);
+
+    if (c != 0)
+	return c;
+    return li != lj ? li - lj : i - j;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs)
+/*
+ * histsort - Bring hist_sorted up to date: sort only the records added
+ *    since the last call and merge them in
+ */
+void histsort(void)
 {
-    int i;
+    int *sorted, i, j, k;
+
+    if (hist_nsorted == hist_n)
+	return;
+    if ((sorted = malloc(2 * hist_n * sizeof(int))) == NULL)
+	return;
+    for (k = hist_nsorted; k < hist_n; k++)
+	sorted[hist_n + k - hist_nsorted] = k;
+    qsort(sorted + hist_n, hist_n - hist_nsorted, sizeof(int), histcmp);
+
+    for (i = 0, j = hist_n, k = 0; k < hist_n; k++)
+	if (j == 2 * hist_n - hist_nsorted ||
+	    (i < hist_nsorted && histcmp(&hist_sorted[i], &sorted[j]) < 0))
+	    sorted[k] = hist_sorted[i++];
+	else
+	    sorted[k] = sorted[j++];
+    free(hist_sorted);
+    hist_sorted = sorted;
+    hist_nsorted = hist_n;
+}
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
-	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-	    switch (jobs[i].state) {
-		case BG:
-		    printf("Running ");
-		    break;
-		case FG:
-		    printf("Foreground ");
-		    break;
-		case ST:
-		    printf("Stopped ");
-		    break;
-	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ",
-			   i, jobs[i].state);
-	    }
-	    printf("%s", jobs[i].cmdline);
-	}
+/* histnumcmp - qsort comparison of two record numbers */
+int histnumcmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * histprefix - Binary search the sorted index for the records starting
+ *    with prefix.  Stores their numbers in found[], oldest first, and
+ *    returns how many there are.
+ */
+int histprefix(char *prefix, int *found)
+{
+    int lo = 0, hi, mid, r, c, n = 0, len = strlen(prefix);
+
+    histsort();
+    hi = hist_nsorted;
+    while (lo < hi) {           /* first record that sorts at or after prefix */
+	mid = (lo + hi) / 2;
+	r = hist_sorted[mid];
+	c = memcmp(hist_map + hist_off[r], prefix, histlen(r) < len ? histlen(r) : len);
+	if (c < 0 || (c == 0 && histlen(r) < len))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (; lo < hist_nsorted; lo++) {   /* they all sit together from there */
+	r = hist_sorted[lo];
+	if (histlen(r) < len || memcmp(hist_map + hist_off[r], prefix, len) != 0)
+	    break;
+	found[n++] = r;
     }
+    qsort(found, n, sizeof(int), histnumcmp);
+    return n;
 }
-/******************************
- * end job list helper routines
- ******************************/
 
+/*
+ * histsearch - Scan the mapped file for substr with memmem, which is
+ *    much faster than going record by record.  Stores the numbers of
+ *    the records containing it in found[], oldest first, and returns
+ *    how many there are.
+ */
+int histsearch(char *substr, int *found)
+{
+    char *p = hist_map, *end = hist_map + hist_indexed;
+    size_t len = strlen(substr);
+    int lo, hi, mid, n = 0;
+
+    while (p < end && (p = memmem(p, end - p, substr, len)) != NULL) {
+	lo = 0;                 /* the record that hit lies in */
+	hi = hist_n - 1;
+	while (lo < hi) {
+	    mid = (lo + hi + 1) / 2;
+	    if (hist_off[mid] <= p - hist_map)
+		lo = mid;
+	    else
+		hi = mid - 1;
+	}
+	found[n++] = lo;
+	p = hist_map + hist_off[lo+1];  /* on to the next record */
+    }
+    return n;
+}
 
 /***********************
  * Other helper routines
@@ -742,10 +3802,15 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void)
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpc] [-j <n>] [-e <fd|file>] [-H <file>]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -c   run each job in its own cgroup; stop and continue freeze it\n");
+    printf("        (a ctrl-z the foreground job catches never reaches tsh to freeze it)\n");
+    printf("   -j <n>  serve <n> job slots to & jobs and makes (GNU make jobserver)\n");
+    printf("   -e <fd|file>  write job lifecycle events as JSON lines to fd or file/FIFO\n");
+    printf("   -H <file>  keep the command history in file (default when interactive: ~/.tsh_history)\n");
     exit(1);
 }
 